@@ -62,12 +62,25 @@ NgxBaseFetch::NgxBaseFetch(StringPiece url,
       base_fetch_type_(base_fetch_type),
       preserve_caching_headers_(preserve_caching_headers),
       detached_(false),
-      suppress_(false) {
+      suppress_(false),
+      capture_(NULL),
+      capture_max_bytes_(0),
+      capture_overflowed_(false),
+      spilling_(false),
+      spill_min_bytes_(0),
+      spill_max_bytes_(0),
+      spill_bytes_(0),
+      spill_output_(NULL) {
   if (pthread_mutex_init(&mutex_, NULL)) CHECK(0);
   __sync_add_and_fetch(&NgxBaseFetch::active_base_fetches, 1);
 }
 
 NgxBaseFetch::~NgxBaseFetch() {
+  // A spill file nobody took, because nginx finished with the request early.
+  if (!spill_file_.empty()) {
+    server_context_->file_system()->RemoveFile(
+        spill_file_.c_str(), server_context_->message_handler());
+  }
   pthread_mutex_destroy(&mutex_);
   __sync_add_and_fetch(&NgxBaseFetch::active_base_fetches, -1);
 }
@@ -216,9 +229,54 @@ bool NgxBaseFetch::HandleWrite(const StringPiece& sp,
   Lock();
   buffer_.append(sp.data(), sp.size());
   Unlock();
+  if (spilling_) {
+    Spill(sp, handler);
+  }
   return true;
 }
 
+void NgxBaseFetch::Spill(const StringPiece& sp, MessageHandler* handler) {
+  spill_bytes_ += sp.size();
+  if (spill_bytes_ > spill_max_bytes_) {
+    FinishSpill(false, handler);
+    return;
+  }
+  if (spill_output_ == NULL) {
+    if (spill_bytes_ < spill_min_bytes_) {
+      spill_pending_.append(sp.data(), sp.size());
+      return;
+    }
+    spill_output_ = server_context_->file_system()->OpenTempFile(
+        spill_prefix_, handler);
+    if (spill_output_ == NULL ||
+        !spill_output_->Write(spill_pending_, handler)) {
+      FinishSpill(false, handler);
+      return;
+    }
+    GoogleString().swap(spill_pending_);
+  }
+  if (!spill_output_->Write(sp, handler)) {
+    FinishSpill(false, handler);
+  }
+}
+
+void NgxBaseFetch::FinishSpill(bool success, MessageHandler* handler) {
+  spilling_ = false;
+  GoogleString().swap(spill_pending_);
+  if (spill_output_ == NULL) {
+    return;
+  }
+  FileSystem* file_system = server_context_->file_system();
+  GoogleString file = spill_output_->filename();
+  bool closed = file_system->Close(spill_output_, handler);
+  spill_output_ = NULL;
+  if (success && closed) {
+    spill_file_ = file;
+  } else {
+    file_system->RemoveFile(file.c_str(), handler);
+  }
+}
+
 // should only be called in nginx thread
 ngx_int_t NgxBaseFetch::CopyBufferToNginx(ngx_chain_t** link_ptr) {
   CHECK(!(done_called_ && last_buf_sent_))
@@ -239,6 +297,16 @@ ngx_int_t NgxBaseFetch::CopyBufferToNginx(ngx_chain_t** link_ptr) {
     return rc;
   }
 
+  if (capture_ != NULL) {
+    if (capture_->size() + buffer_.size() > capture_max_bytes_) {
+      capture_->clear();
+      capture_ = NULL;
+      capture_overflowed_ = true;
+    } else {
+      capture_->append(buffer_);
+    }
+  }
+
   // Done with buffer contents now.
   buffer_.clear();
 
@@ -347,6 +415,10 @@ void NgxBaseFetch::HandleDone(bool success) {
   // TODO(jefftk): it's possible that instead of locking here we can just modify
   // CopyBufferToNginx to only read done_called_ once.
   CHECK(!done_called_) << "Done already called!";
+  // Finished before nginx hears about it, so it finds the file complete.
+  if (spilling_) {
+    FinishSpill(success, server_context_->message_handler());
+  }
   Lock();
   done_called_ = true;
   Unlock();
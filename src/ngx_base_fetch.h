@@ -66,6 +66,7 @@ extern "C" {
 
 #include "net/instaweb/http/public/async_fetch.h"
 #include "net/instaweb/rewriter/public/rewrite_options.h"
+#include "pagespeed/kernel/base/file_system.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/http/headers.h"
 
@@ -134,6 +135,37 @@ class NgxBaseFetch : public AsyncFetch {
   ngx_http_request_t* request() { return request_; }
   NgxBaseFetchType base_fetch_type() { return base_fetch_type_; }
 
+  // Makes CollectAccumulatedWrites() also append everything it hands to nginx
+  // to *capture, so the complete response body can be cached once we're done.
+  // If the body grows beyond max_bytes, capture is cleared and
+  // capture_overflowed() starts returning true.  Called by nginx, which owns
+  // capture and must keep it alive while it collects writes.
+  void StartCapture(GoogleString* capture, size_t max_bytes) {
+    capture_ = capture;
+    capture_max_bytes_ = max_bytes;
+  }
+  bool capture_overflowed() const { return capture_overflowed_; }
+
+  // Makes pagespeed also write the response body to a temporary file named
+  // after file_prefix, from its own thread, once the body reaches min_bytes.
+  // The file is removed again if the body grows beyond max_bytes or the fetch
+  // fails.  Called by nginx before the fetch starts.
+  void StartSpill(const GoogleString& file_prefix, size_t min_bytes,
+                  size_t max_bytes) {
+    spill_prefix_ = file_prefix;
+    spill_min_bytes_ = min_bytes;
+    spill_max_bytes_ = max_bytes;
+    spilling_ = true;
+  }
+  // Once done, returns the name of the temporary file holding the complete
+  // body, or an empty string if there is none.  The caller then owns the file,
+  // and must rename or remove it.
+  GoogleString TakeSpillFile() {
+    GoogleString file;
+    file.swap(spill_file_);
+    return file;
+  }
+
   bool IsCachedResultValid(const ResponseHeaders& headers) override;
 
  private:
@@ -155,6 +187,11 @@ class NgxBaseFetch : public AsyncFetch {
   // buffer_.
   ngx_int_t CopyBufferToNginx(ngx_chain_t** link_ptr);
 
+  // Writes to, and closes or abandons, the spill file.  Only called from
+  // pagespeed's side, so nginx never waits for the disk.
+  void Spill(const StringPiece& sp, MessageHandler* handler);
+  void FinishSpill(bool success, MessageHandler* handler);
+
   void Lock();
   void Unlock();
 
@@ -186,6 +223,19 @@ class NgxBaseFetch : public AsyncFetch {
   // Set to true just before the nginx side releases its reference
   bool detached_;
   bool suppress_;
+  GoogleString* capture_;
+  size_t capture_max_bytes_;
+  bool capture_overflowed_;
+  bool spilling_;
+  GoogleString spill_prefix_;
+  size_t spill_min_bytes_;
+  size_t spill_max_bytes_;
+  size_t spill_bytes_;
+  // Holds the body until it reaches spill_min_bytes_, so small responses never
+  // touch the disk.
+  GoogleString spill_pending_;
+  FileSystem::OutputFile* spill_output_;
+  GoogleString spill_file_;
 
   DISALLOW_COPY_AND_ASSIGN(NgxBaseFetch);
 };
@@ -27,9 +27,6 @@
 //  - The read handler parses the response. Add the response to the buffer at
 //    last.
 
-// TODO(oschaaf): Currently the first applicable connection is picked from the
-// pool when re-using connections. Perhaps it would be worth it to pick the one
-// that was active the longest time ago to keep a larger pool available.
 // TODO(oschaaf): style: reindent namespace according to google C++ style guide
 // TODO(oschaaf): Retry mechanism for failures on a re-used k-a connection.
 // Currently we don't think it's going to be an issue, see the comments at
@@ -45,7 +42,6 @@ extern "C" {
 
 #include <algorithm>
 #include <string>
-#include <typeinfo>
 #include <vector>
 
 #include "net/instaweb/http/public/async_fetch.h"
@@ -70,7 +66,173 @@ extern "C" {
 
 namespace net_instaweb {
 
-NgxConnection::NgxConnectionPool NgxConnection::connection_pool;
+namespace {
+
+const char kIdleConnections[] = "native_fetcher_idle_connections";
+const char kConnectionReuses[] = "native_fetcher_connection_reuses";
+const char kIdleEvictions[] = "native_fetcher_idle_evictions";
+const char kDnsCacheHits[] = "native_fetcher_dns_cache_hits";
+const char kDnsCacheMisses[] = "native_fetcher_dns_cache_misses";
+const char kDnsResolutions[] = "native_fetcher_dns_resolutions";
+const char kDnsResolveTimeMs[] = "native_fetcher_dns_resolve_time_ms";
+const char kAddressFailovers[] = "native_fetcher_address_failovers";
+
+// How long we remember that a name didn't resolve.
+const int64 kDnsNegativeTtlMs = 10 * Timer::kSecondMs;
+// How long we keep addresses when the resolver doesn't tell us their TTL.
+const int64 kDnsDefaultTtlMs = 60 * Timer::kSecondMs;
+// Host names we keep addresses for, per worker.
+const size_t kDnsCacheMaxEntries = 1000;
+// How long we avoid an address we couldn't connect to.
+const int64 kAddressCooldownMs = 30 * Timer::kSecondMs;
+
+// We read the status line and headers into this much, and the body into up
+// to kMaxInputBufferSize.
+const size_t kInitialInputBufferSize = 4096;
+const size_t kMaxInputBufferSize = 256 * 1024;
+
+}  // namespace
+
+NgxDnsCache::EntryMap NgxDnsCache::entries_;
+std::map<in_addr_t, int64> NgxDnsCache::down_until_ms_;
+Variable* NgxDnsCache::hits_ = NULL;
+Variable* NgxDnsCache::misses_ = NULL;
+Variable* NgxDnsCache::resolutions_ = NULL;
+Variable* NgxDnsCache::resolve_time_ms_ = NULL;
+Variable* NgxDnsCache::failovers_ = NULL;
+
+void NgxDnsCache::InitStats(Statistics* statistics) {
+  statistics->AddVariable(kDnsCacheHits);
+  statistics->AddVariable(kDnsCacheMisses);
+  statistics->AddVariable(kDnsResolutions);
+  statistics->AddVariable(kDnsResolveTimeMs);
+  statistics->AddVariable(kAddressFailovers);
+}
+
+void NgxDnsCache::Init(Statistics* statistics) {
+  hits_ = statistics->GetVariable(kDnsCacheHits);
+  misses_ = statistics->GetVariable(kDnsCacheMisses);
+  resolutions_ = statistics->GetVariable(kDnsResolutions);
+  resolve_time_ms_ = statistics->GetVariable(kDnsResolveTimeMs);
+  failovers_ = statistics->GetVariable(kAddressFailovers);
+}
+
+NgxDnsCache::Entry* NgxDnsCache::Lookup(const GoogleString& host,
+                                              int64 now_ms) {
+  EntryMap::iterator p = entries_.find(host);
+  if (p != entries_.end() && p->second.expiration_ms <= now_ms) {
+    entries_.erase(p);
+    p = entries_.end();
+  }
+  if (p == entries_.end()) {
+    if (misses_ != NULL) {
+      misses_->Add(1);
+    }
+    return NULL;
+  }
+  if (hits_ != NULL) {
+    hits_->Add(1);
+  }
+  return &p->second;
+}
+
+void NgxDnsCache::Insert(const GoogleString& host,
+                         const std::vector<struct sockaddr_in>& addresses,
+                         int64 ttl_ms, int64 now_ms) {
+  if (ttl_ms <= 0) {
+    return;
+  }
+  if (entries_.size() >= kDnsCacheMaxEntries &&
+      entries_.find(host) == entries_.end()) {
+    // Make room, preferring to drop what has expired already.
+    EntryMap::iterator victim = entries_.begin();
+    for (EntryMap::iterator p = entries_.begin(); p != entries_.end(); ++p) {
+      if (p->second.expiration_ms <= now_ms) {
+        victim = p;
+        break;
+      }
+    }
+    entries_.erase(victim);
+  }
+  Entry* entry = &entries_[host];
+  entry->addresses = addresses;
+  entry->expiration_ms = now_ms + ttl_ms;
+  // The fetch that resolved host starts with the first address.
+  entry->next = 1;
+}
+
+void NgxDnsCache::InsertNegative(const GoogleString& host, int64 now_ms) {
+  Insert(host, std::vector<struct sockaddr_in>(), kDnsNegativeTtlMs, now_ms);
+}
+
+void NgxDnsCache::RecordResolution(int64 elapsed_ms) {
+  if (resolutions_ != NULL) {
+    resolutions_->Add(1);
+    resolve_time_ms_->Add(elapsed_ms);
+  }
+}
+
+void NgxDnsCache::OrderAddresses(
+    const std::vector<struct sockaddr_in>& addresses, size_t first,
+    int64 now_ms, std::vector<struct sockaddr_in>* ordered) {
+  ordered->clear();
+  std::vector<struct sockaddr_in> down;
+  for (size_t i = 0, n = addresses.size(); i < n; ++i) {
+    const struct sockaddr_in& address = addresses[(first + i) % n];
+    if (IsDown(address.sin_addr.s_addr, now_ms)) {
+      down.push_back(address);
+    } else {
+      ordered->push_back(address);
+    }
+  }
+  // If they all seem down we still try them, as they may have come back.
+  ordered->insert(ordered->end(), down.begin(), down.end());
+}
+
+void NgxDnsCache::MarkDown(const struct sockaddr_in& address, int64 now_ms) {
+  if (down_until_ms_.size() >= kDnsCacheMaxEntries) {
+    for (std::map<in_addr_t, int64>::iterator p = down_until_ms_.begin();
+         p != down_until_ms_.end();) {
+      if (p->second <= now_ms) {
+        down_until_ms_.erase(p++);
+      } else {
+        ++p;
+      }
+    }
+    if (down_until_ms_.size() >= kDnsCacheMaxEntries) {
+      down_until_ms_.erase(down_until_ms_.begin());
+    }
+  }
+  down_until_ms_[address.sin_addr.s_addr] = now_ms + kAddressCooldownMs;
+}
+
+bool NgxDnsCache::IsDown(in_addr_t address, int64 now_ms) {
+  std::map<in_addr_t, int64>::iterator p = down_until_ms_.find(address);
+  if (p == down_until_ms_.end()) {
+    return false;
+  }
+  if (p->second <= now_ms) {
+    down_until_ms_.erase(p);
+    return false;
+  }
+  return true;
+}
+
+void NgxDnsCache::RecordFailover() {
+  if (failovers_ != NULL) {
+    failovers_->Add(1);
+  }
+}
+
+std::map<GoogleString, NgxConnection::NgxConnectionList>
+    NgxConnection::idle_by_peer_;
+NgxConnection::NgxConnectionList NgxConnection::idle_lru_;
+int NgxConnection::idle_count_ = 0;
+int NgxConnection::max_idle_ = 512;
+int NgxConnection::max_idle_per_peer_ = 32;
+UpDownCounter* NgxConnection::idle_connections_ = NULL;
+Variable* NgxConnection::connection_reuses_ = NULL;
+Variable* NgxConnection::idle_evictions_ = NULL;
 PthreadMutex NgxConnection::connection_pool_mutex;
 // Default keepalive 60s.
 const int64 NgxConnection::keepalive_timeout_ms = 60000;
@@ -83,6 +245,10 @@ NgxConnection::NgxConnection(MessageHandler* handler,
   c_ = NULL;
   max_keepalive_requests_ = max_keepalive_requests;
   handler_ = handler;
+  reused_ = false;
+  upstream_ = NULL;
+  peer_state_ = 0;
+  pooled_ = false;
   // max_keepalive_requests specifies the number of http requests that are
   // allowed to be performed over a single connection. So, a
   // max_keepalive_requests of 1 effectively disables keepalive.
@@ -93,51 +259,118 @@ NgxConnection::~NgxConnection() {
   CHECK(c_ == NULL) << "NgxConnection: Underlying connection should be NULL";
 }
 
+void NgxConnection::InitStats(Statistics* statistics) {
+  statistics->AddUpDownCounter(kIdleConnections);
+  statistics->AddVariable(kConnectionReuses);
+  statistics->AddVariable(kIdleEvictions);
+}
+
+void NgxConnection::InitPool(Statistics* statistics, int max_idle,
+                             int max_idle_per_peer) {
+  max_idle_ = max_idle;
+  max_idle_per_peer_ = max_idle_per_peer;
+  idle_connections_ = statistics->GetUpDownCounter(kIdleConnections);
+  connection_reuses_ = statistics->GetVariable(kConnectionReuses);
+  idle_evictions_ = statistics->GetVariable(kIdleEvictions);
+}
+
 void NgxConnection::Terminate() {
-  for (NgxConnectionPool::iterator p = connection_pool.begin();
-       p != connection_pool.end(); ++p) {
+  ScopedMutex lock(&NgxConnection::connection_pool_mutex);
+  for (NgxConnectionList::iterator p = idle_lru_.begin();
+       p != idle_lru_.end(); ++p) {
     NgxConnection* nc = *p;
-    ngx_close_connection(nc->c_);
-    nc->c_ = NULL;
+    nc->CloseSocket();
     delete nc;
   }
-  connection_pool.Clear();
+  if (idle_connections_ != NULL) {
+    idle_connections_->Add(-idle_count_);
+  }
+  idle_lru_.clear();
+  idle_by_peer_.clear();
+  idle_count_ = 0;
+}
+
+void NgxConnection::AddToPool(std::vector<NgxConnection*>* evicted) {
+  NgxConnectionList* peer_list = &idle_by_peer_[PeerKey()];
+  peer_list->push_front(this);
+  peer_position_ = peer_list->begin();
+  idle_lru_.push_back(this);
+  lru_position_ = --idle_lru_.end();
+  pooled_ = true;
+  ++idle_count_;
+  if (idle_connections_ != NULL) {
+    idle_connections_->Add(1);
+  }
+
+  // Make room by giving up on the connections idle the longest: this peer's
+  // if it has too many, and then anyone's.
+  if (static_cast<int>(peer_list->size()) > max_idle_per_peer_) {
+    NgxConnection* oldest = peer_list->back();
+    oldest->RemoveFromPool();
+    evicted->push_back(oldest);
+  }
+  while (idle_count_ > max_idle_) {
+    NgxConnection* oldest = idle_lru_.front();
+    oldest->RemoveFromPool();
+    evicted->push_back(oldest);
+  }
+}
+
+void NgxConnection::RemoveFromPool() {
+  GoogleString key = PeerKey();
+  std::map<GoogleString, NgxConnectionList>::iterator peer =
+      idle_by_peer_.find(key);
+  CHECK(pooled_ && peer != idle_by_peer_.end());
+  peer->second.erase(peer_position_);
+  if (peer->second.empty()) {
+    idle_by_peer_.erase(peer);
+  }
+  idle_lru_.erase(lru_position_);
+  pooled_ = false;
+  --idle_count_;
+  if (idle_connections_ != NULL) {
+    idle_connections_->Add(-1);
+  }
 }
 
 NgxConnection* NgxConnection::Connect(ngx_peer_connection_t* pc,
+                                      StringPiece ssl_name,
                                       MessageHandler* handler,
-                                      int max_keepalive_requests) {
+                                      int max_keepalive_requests,
+                                      bool allow_reuse) {
   NgxConnection* nc;
-  {
+  if (allow_reuse) {
     ScopedMutex lock(&NgxConnection::connection_pool_mutex);
 
-    for (NgxConnectionPool::iterator p = connection_pool.begin();
-         p != connection_pool.end(); ++p) {
-      nc = *p;
-
-      if (ngx_memn2cmp(static_cast<u_char*>(nc->sockaddr_),
-                       reinterpret_cast<u_char*>(pc->sockaddr),
-                       nc->socklen_, pc->socklen) == 0) {
-        CHECK(nc->c_->idle) << "Pool should only contain idle connections!";
-
-        nc->c_->idle = 0;
-        nc->c_->log = pc->log;
-        nc->c_->read->log = pc->log;
-        nc->c_->write->log = pc->log;
-        if (nc->c_->pool != NULL) {
-          nc->c_->pool->log = pc->log;
-        }
-
-        if (nc->c_->read->timer_set) {
-          ngx_del_timer(nc->c_->read);
-        }
-        connection_pool.Remove(nc);
+    GoogleString key = PeerKey(reinterpret_cast<u_char*>(pc->sockaddr),
+                               pc->socklen, ssl_name);
+    std::map<GoogleString, NgxConnectionList>::iterator peer =
+        idle_by_peer_.find(key);
+    if (peer != idle_by_peer_.end()) {
+      nc = peer->second.front();
+      CHECK(nc->c_->idle) << "Pool should only contain idle connections!";
+      nc->RemoveFromPool();
+      nc->reused_ = true;
+
+      nc->c_->idle = 0;
+      nc->c_->log = pc->log;
+      nc->c_->read->log = pc->log;
+      nc->c_->write->log = pc->log;
+      if (nc->c_->pool != NULL) {
+        nc->c_->pool->log = pc->log;
+      }
 
-        ngx_log_error(NGX_LOG_DEBUG, pc->log, 0,
-                      "NgxFetch: re-using connection %p (pool size: %l)",
-                      nc, connection_pool.size());
-        return nc;
+      if (nc->c_->read->timer_set) {
+        ngx_del_timer(nc->c_->read);
+      }
+      if (connection_reuses_ != NULL) {
+        connection_reuses_->Add(1);
       }
+
+      ngx_log_error(NGX_LOG_DEBUG, pc->log, 0,
+                    "NgxFetch: re-using connection %p (pool size: %d)",
+                    nc, idle_count_);
+      return nc;
     }
   }
 
@@ -149,27 +382,102 @@ NgxConnection* NgxConnection::Connect(ngx_peer_connection_t* pc,
   // NgxConnection deletes itself if NgxConnection::Close()
   nc = new NgxConnection(handler, max_keepalive_requests);
   nc->SetSock(reinterpret_cast<u_char*>(pc->sockaddr), pc->socklen);
+  ssl_name.CopyToString(&nc->ssl_name_);
   nc->c_ = pc->connection;
   return nc;
 }
 
+NgxConnection* NgxConnection::ConnectUpstream(ngx_http_upstream_t* u,
+                                              MessageHandler* handler,
+                                              int max_keepalive_requests) {
+  ngx_peer_connection_t* pc = &u->peer;
+  int rc = ngx_event_connect_peer(pc);
+  // Like ngx_http_upstream_next(): servers we can't connect to count as
+  // failed, and we move on to the next one while the block allows it.
+  while (rc == NGX_DECLINED && pc->free != NULL) {
+    pc->free(pc, pc->data, NGX_PEER_FAILED);
+    if (pc->tries == 0) {
+      return NULL;
+    }
+    rc = ngx_event_connect_peer(pc);
+  }
+  if (rc == NGX_ERROR || rc == NGX_DECLINED || rc == NGX_BUSY) {
+    // NGX_BUSY means no server was up; there's nothing to hand back then.
+    if (rc == NGX_ERROR && pc->sockaddr != NULL && pc->free != NULL) {
+      pc->free(pc, pc->data, 0);
+    }
+    return NULL;
+  }
+
+  NgxConnection* nc = new NgxConnection(handler, max_keepalive_requests);
+  nc->upstream_ = u;
+  // NGX_DONE is the keepalive module handing us a cached connection.
+  nc->reused_ = (rc == NGX_DONE);
+  nc->c_ = pc->connection;
+  // The keepalive module destroys the pool of connections it closes.
+  if (nc->c_->pool == NULL) {
+    nc->c_->pool = ngx_create_pool(128, pc->log);
+    if (nc->c_->pool == NULL) {
+      nc->set_peer_failed();
+      nc->set_keepalive(false);
+      nc->Close();
+      return NULL;
+    }
+  }
+  return nc;
+}
+
+void NgxConnection::ReleaseToUpstream() {
+  ngx_peer_connection_t* pc = &upstream_->peer;
+  // The keepalive module only caches connections the response left usable.
+  upstream_->keepalive = keepalive_ && peer_state_ == 0;
+#if (nginx_version >= 1017000)
+  upstream_->request_body_sent = 1;
+#endif
+  pc->connection = c_;
+  if (pc->free != NULL) {
+    pc->free(pc, pc->data, peer_state_);
+  }
+  if (pc->connection != NULL) {
+    // Nothing kept it.
+    pc->connection = NULL;
+    CloseSocket();
+  } else {
+    c_ = NULL;
+  }
+}
+
+void NgxConnection::CloseSocket() {
+#if (NGX_SSL)
+  if (c_->ssl != NULL) {
+    // We're done with the connection either way, so don't wait for the
+    // origin's close_notify.
+    c_->ssl->no_wait_shutdown = 1;
+    c_->ssl->no_send_shutdown = 1;
+    ngx_ssl_shutdown(c_);
+  }
+#endif
+  ngx_pool_t* pool = c_->pool;
+  ngx_close_connection(c_);
+  if (pool != NULL) {
+    ngx_destroy_pool(pool);
+  }
+  c_ = NULL;
+}
+
 void NgxConnection::Close() {
   bool removed_from_pool = false;
 
   {
     ScopedMutex lock(&NgxConnection::connection_pool_mutex);
-    for (NgxConnectionPool::iterator p = connection_pool.begin();
-         p != connection_pool.end(); ++p) {
-      if (*p == this) {
-        // When we get here, that means that the connection either has timed
-        // out or has been closed remotely.
-        connection_pool.Remove(this);
-        ngx_log_error(NGX_LOG_DEBUG, c_->log, 0,
-                      "NgxFetch: removed connection %p (pool size: %l)",
-                      this, connection_pool.size());
-        removed_from_pool = true;
-        break;
-      }
+    if (pooled_) {
+      // When we get here, that means that the connection either has timed
+      // out or has been closed remotely.
+      RemoveFromPool();
+      ngx_log_error(NGX_LOG_DEBUG, c_->log, 0,
+                    "NgxFetch: removed connection %p (pool size: %d)",
+                    this, idle_count_);
+      removed_from_pool = true;
     }
   }
 
@@ -183,9 +491,14 @@ void NgxConnection::Close() {
     ngx_del_timer(c_->write);
   }
 
+  if (upstream_ != NULL) {
+    ReleaseToUpstream();
+    delete this;
+    return;
+  }
+
   if (!keepalive_ || max_keepalive_requests_ <= 0 || removed_from_pool) {
-    ngx_close_connection(c_);
-    c_ = NULL;
+    CloseSocket();
     delete this;
     return;
   }
@@ -207,13 +520,23 @@ void NgxConnection::Close() {
   }
 
   // Allow this connection to be re-used, by adding it to the connection pool.
+  std::vector<NgxConnection*> evicted;
   {
     ScopedMutex lock(&NgxConnection::connection_pool_mutex);
-    connection_pool.Add(this);
-    ngx_log_error(NGX_LOG_DEBUG, c_->log, 0,
-                  "NgxFetch: Added connection %p (pool size: %l - "
+    AddToPool(&evicted);
+    ngx_log_error(NGX_LOG_DEBUG, ngx_cycle->log, 0,
+                  "NgxFetch: Added connection %p (pool size: %d - "
                   " max_keepalive_requests_ %d)",
-                  this, connection_pool.size(), max_keepalive_requests_);
+                  this, idle_count_, max_keepalive_requests_);
+  }
+
+  // Close what didn't fit outside the lock, as Close() takes it too.
+  for (int i = 0, n = evicted.size(); i < n; ++i) {
+    if (idle_evictions_ != NULL) {
+      idle_evictions_->Add(1);
+    }
+    evicted[i]->set_keepalive(false);
+    evicted[i]->Close();
   }
 }
 
@@ -263,6 +586,7 @@ NgxFetch::NgxFetch(const GoogleString& url,
                    MessageHandler* message_handler,
                    ngx_log_t* log)
     : str_url_(url),
+      background_(false),
       fetcher_(NULL),
       async_fetch_(async_fetch),
       parser_(async_fetch->response_headers()),
@@ -273,8 +597,23 @@ NgxFetch::NgxFetch(const GoogleString& url,
       done_(false),
       content_length_(-1),
       content_length_known_(false),
+      chunked_(false),
+      ssl_(false),
+      upstream_(NULL),
+      loopback_(false),
+      resolve_start_ms_(0),
+      resolve_end_ms_(0),
+      connect_start_ms_(0),
+      write_start_ms_(0),
+      request_sent_ms_(0),
+      first_byte_ms_(0),
+      next_address_(0),
+      origin_responded_(false),
+      retried_reused_(false),
+      last_read_filled_(false),
       resolver_ctx_(NULL) {
   ngx_memzero(&url_, sizeof(url_));
+  ngx_memzero(&chunked_parser_, sizeof(chunked_parser_));
   log_ = log;
   pool_ = NULL;
   timeout_event_ = NULL;
@@ -290,7 +629,7 @@ NgxFetch::~NgxFetch() {
     connection_ = NULL;
   }
   if (pool_ != NULL) {
-    ngx_destroy_pool(pool_);
+    fetcher_->ReleasePool(pool_);
     pool_ = NULL;
   }
 }
@@ -298,6 +637,7 @@ NgxFetch::~NgxFetch() {
 // This function is called by NgxUrlAsyncFetcher::StartFetch.
 bool NgxFetch::Start(NgxUrlAsyncFetcher* fetcher) {
   fetcher_ = fetcher;
+  fetch_start_ms_ = ngx_current_msec;
   bool ok = Init();
   if (ok) {
     ngx_log_error(NGX_LOG_DEBUG, log_, 0, "NgxFetch %p: initialized",
@@ -311,7 +651,7 @@ bool NgxFetch::Start(NgxUrlAsyncFetcher* fetcher) {
 // When this returns false, our caller (NgxUrlAsyncFetcher::StartFetch)
 // will call fetch->CallbackDone()
 bool NgxFetch::Init() {
-  pool_ = ngx_create_pool(12288, log_);
+  pool_ = fetcher_->AcquirePool();
   if (pool_ == NULL) {
     message_handler_->Message(kError, "NgxFetch: ngx_create_pool failed");
     return false;
@@ -324,6 +664,22 @@ bool NgxFetch::Init() {
     return false;
   }
 
+  if (ssl_) {
+    // We don't tunnel https through the fetcher proxy.
+#if (NGX_SSL)
+    bool ssl_ok = fetcher_->SupportsHttps() &&
+        fetcher_->proxy_.url.len == 0 && fetcher_->InitSsl();
+#else
+    bool ssl_ok = false;
+#endif
+    if (!ssl_ok) {
+      message_handler_->Message(kError,
+                                "NgxFetch: can't fetch [%s] over https",
+                                str_url_.c_str());
+      return false;
+    }
+  }
+
   timeout_event_ = static_cast<ngx_event_t*>(
       ngx_pcalloc(pool_, sizeof(ngx_event_t)));
   if (timeout_event_ == NULL) {
@@ -354,6 +710,20 @@ bool NgxFetch::Init() {
     return false;
   }
 
+  // Hosts named after an upstream{} block we were told to use get their
+  // servers from it; there's nothing to resolve.
+  if (!ssl_ && fetcher_->proxy_.url.len == 0) {
+    upstream_ = fetcher_->FindUpstream(url_);
+  }
+  if (upstream_ != NULL) {
+    fetcher_->upstream_fetches_->Add(1);
+    if (InitRequest() != NGX_OK) {
+      message_handler()->Message(kError, "NgxFetch: InitRequest failed");
+      return false;
+    }
+    return true;
+  }
+
   // The host is either a domain name or an IP address.  First check
   // if it's a valid IP address and only if that fails fall back to
   // using the DNS resolver.
@@ -373,7 +743,26 @@ bool NgxFetch::Init() {
 
   if (sin_.sin_addr.s_addr == INADDR_NONE) {
     // inet_addr returned INADDR_NONE, which means the hostname
-    // isn't a valid IP address.  Check DNS.
+    // isn't a valid IP address.  See if we resolved it recently.
+    LowerString(&s_ipaddress);
+    NgxDnsCache::Entry* cached =
+        NgxDnsCache::Lookup(s_ipaddress, ngx_current_msec);
+    if (cached != NULL) {
+      if (cached->addresses.empty()) {
+        message_handler_->Message(
+            kWarning, "NgxFetch: host [%s] recently failed to resolve",
+            s_ipaddress.c_str());
+        return false;
+      }
+      NgxDnsCache::OrderAddresses(cached->addresses, cached->next++,
+                                  ngx_current_msec, &addresses_);
+      sin_.sin_addr = addresses_[0].sin_addr;
+      next_address_ = 1;
+    }
+  }
+
+  if (sin_.sin_addr.s_addr == INADDR_NONE) {
+    // Check DNS.
     ngx_resolver_ctx_t temp;
     temp.name.data = tmp_url->host.data;
     temp.name.len = tmp_url->host.len;
@@ -401,6 +790,7 @@ bool NgxFetch::Init() {
 
     resolver_ctx_->handler = NgxFetch::ResolveDoneHandler;
     resolver_ctx_->timeout = fetcher_->resolver_timeout_;
+    resolve_start_ms_ = ngx_current_msec;
 
     if (ngx_resolve_name(resolver_ctx_) != NGX_OK) {
       message_handler_->Message(kWarning,
@@ -436,40 +826,83 @@ void NgxFetch::CallbackDone(bool success) {
 
   release_resolver();
 
+  // Counted by the address we ended up talking to, after any failover.
+  if (connect_start_ms_ != 0) {
+    if (loopback_) {
+      fetcher_->loopback_fetches_->Add(1);
+    } else {
+      fetcher_->remote_fetches_->Add(1);
+    }
+  }
+
   if (timeout_event_ && timeout_event_->timer_set) {
     ngx_del_timer(timeout_event_);
     timeout_event_ = NULL;
   }
 
   if (connection_ != NULL) {
-    // Connection will be re-used only on responses that specify
-    // 'Connection: keep-alive' in their headers.
+    // Connection will be re-used on HTTP/1.1 responses unless they specify
+    // 'Connection: close', and on HTTP/1.0 responses only if they specify
+    // 'Connection: keep-alive'.  Either way the response has to tell us where
+    // it ends, or the server will have closed the connection to mark that.
     bool keepalive = false;
 
     if (success) {
+#if (NGX_SSL)
+      if (connection_->c_->ssl != NULL) {
+        // TLS 1.3 servers only send session tickets after the handshake, so
+        // we hold on to the session once the response is in.
+        fetcher_->SaveSslSession(SslOrigin(), connection_->c_);
+      }
+#endif
+      ResponseHeaders* response_headers = async_fetch_->response_headers();
+      keepalive = response_headers->major_version() == 1 &&
+          response_headers->minor_version() >= 1;
       ConstStringStarVector v;
-      if (async_fetch_->response_headers()->Lookup(
+      if (response_headers->Lookup(
               StringPiece(HttpAttributes::kConnection), &v)) {
         for (size_t i = 0; i < v.size(); i++) {
-          if (*v[i] == "keep-alive") {
+          if (StringCaseEqual(*v[i], "keep-alive")) {
             keepalive = true;
             break;
-          } else if (*v[i] == "close") {
+          } else if (StringCaseEqual(*v[i], "close")) {
+            keepalive = false;
             break;
           }
         }
       }
+      keepalive = keepalive &&
+          (content_length_known_ || chunked_ ||
+           get_status_code() == 304 || get_status_code() == 204);
       ngx_log_error(NGX_LOG_DEBUG, log_, 0,
                     "NgxFetch %p: connection %p attempt keep-alive: %s",
                     this, connection_, keepalive ? "Yes":"No");
     }
 
     connection_->set_keepalive(keepalive);
+    if (!success) {
+      connection_->set_peer_failed();
+    }
     connection_->Close();
     connection_ = NULL;
   }
 
   if (fetcher_ != NULL) {
+    fetch_end_ms_ = ngx_current_msec;
+    if (success && first_byte_ms_ != 0) {
+      int64 phase_ms[NgxUrlAsyncFetcher::kNumFetchPhases];
+      phase_ms[NgxUrlAsyncFetcher::kDnsPhase] =
+          resolve_end_ms_ - resolve_start_ms_;
+      phase_ms[NgxUrlAsyncFetcher::kConnectPhase] =
+          write_start_ms_ - connect_start_ms_;
+      phase_ms[NgxUrlAsyncFetcher::kWriteRequestPhase] =
+          request_sent_ms_ - write_start_ms_;
+      phase_ms[NgxUrlAsyncFetcher::kFirstBytePhase] =
+          first_byte_ms_ - request_sent_ms_;
+      phase_ms[NgxUrlAsyncFetcher::kBodyPhase] =
+          fetch_end_ms_ - first_byte_ms_;
+      fetcher_->RecordTimings(origin_, phase_ms, fetch_end_ms_);
+    }
     if (fetcher_->track_original_content_length()
         && async_fetch_->response_headers()->Has(
             HttpAttributes::kXOriginalContentLength)) {
@@ -516,16 +949,34 @@ bool NgxFetch::ParseUrl() {
     return false;
   }
   str_url_.copy(reinterpret_cast<char*>(url_.url.data), str_url_.length(), 0);
+  ssl_ = StringCaseStartsWith(str_url_, "https://");
 
   return NgxUrlAsyncFetcher::ParseUrl(&url_, pool_);
 }
 
+GoogleString NgxFetch::SslOrigin() const {
+  return StrCat(StringPiece(reinterpret_cast<char*>(url_.host.data),
+                            url_.host.len),
+                ":", IntegerToString(url_.port));
+}
+
 // Issue a request after the resolver is done
 void NgxFetch::ResolveDoneHandler(ngx_resolver_ctx_t* resolver_ctx) {
   NgxFetch* fetch = static_cast<NgxFetch*>(resolver_ctx->data);
   NgxUrlAsyncFetcher* fetcher = fetch->fetcher_;
+  GoogleString host(reinterpret_cast<char*>(resolver_ctx->name.data),
+                    resolver_ctx->name.len);
+  LowerString(&host);
+  int64 now_ms = ngx_current_msec;
+  fetch->resolve_end_ms_ = now_ms;
+  NgxDnsCache::RecordResolution(now_ms - fetch->resolve_start_ms_);
 
   if (resolver_ctx->state != NGX_OK) {
+    // Only an authoritative "no such name" is worth remembering; timeouts
+    // and server failures may well clear up by the next fetch.
+    if (resolver_ctx->state == NGX_RESOLVE_NXDOMAIN) {
+      NgxDnsCache::InsertNegative(host, now_ms);
+    }
     if (fetch->timeout_event() != NULL && fetch->timeout_event()->timer_set) {
       ngx_del_timer(fetch->timeout_event());
       fetch->set_timeout_event(NULL);
@@ -537,25 +988,35 @@ void NgxFetch::ResolveDoneHandler(ngx_resolver_ctx_t* resolver_ctx) {
     return;
   }
 
-  ngx_uint_t i;
-  // Find the first ipv4 address. We don't support ipv6 yet.
-  for (i = 0; i < resolver_ctx->naddrs; i++) {
-    // Old versions of nginx and tengine have a different definition of addrs,
-    // work around to make sure we are using the right type (ngx_addr_t*).
-    ngx_addr_t* ngx_addrs = reinterpret_cast<ngx_addr_t*>(resolver_ctx->addrs);
-    if (typeid(*ngx_addrs) == typeid(*resolver_ctx->addrs)) {
-      if (reinterpret_cast<struct sockaddr_in*>(ngx_addrs[i].sockaddr)
-              ->sin_family == AF_INET) {
-        break;
-      }
-    } else {
-      // We're using an old version that uses in_addr_t* for addrs.
-      break;
+  // Keep all the ipv4 addresses. We don't support ipv6 yet.
+  std::vector<struct sockaddr_in> addresses;
+  for (ngx_uint_t i = 0; i < resolver_ctx->naddrs; i++) {
+    struct sockaddr_in address;
+    ngx_memzero(&address, sizeof(address));
+    address.sin_family = AF_INET;
+#if (nginx_version < 1005008)
+    address.sin_addr.s_addr = resolver_ctx->addrs[i];
+#else
+    struct sockaddr_in* sin = reinterpret_cast<struct sockaddr_in*>(
+        resolver_ctx->addrs[i].sockaddr);
+    if (sin->sin_family != AF_INET) {
+      continue;
     }
+    address.sin_addr.s_addr = sin->sin_addr.s_addr;
+#endif
+    addresses.push_back(address);
   }
 
+  // The resolver tells us how long its answer is good for since 1.9.13.
+#if (nginx_version >= 1009013)
+  int64 ttl_ms = (resolver_ctx->valid - ngx_time()) * Timer::kSecondMs;
+#else
+  int64 ttl_ms = kDnsDefaultTtlMs;
+#endif
+
   // If no suitable ipv4 address was found, we fail.
-  if (i == resolver_ctx->naddrs) {
+  if (addresses.empty()) {
+    NgxDnsCache::InsertNegative(host, now_ms);
     if (fetch->timeout_event() != NULL && fetch->timeout_event()->timer_set) {
       ngx_del_timer(fetch->timeout_event());
       fetch->set_timeout_event(NULL);
@@ -564,22 +1025,14 @@ void NgxFetch::ResolveDoneHandler(ngx_resolver_ctx_t* resolver_ctx) {
         kWarning, "NgxFetch %p: no suitable address for host [%.*s]", fetch,
         static_cast<int>(resolver_ctx->name.len), resolver_ctx->name.data);
     fetch->CallbackDone(false);
+    return;
   }
+  NgxDnsCache::Insert(host, addresses, ttl_ms, now_ms);
+  NgxDnsCache::OrderAddresses(addresses, 0, now_ms, &fetch->addresses_);
+  fetch->next_address_ = 1;
 
   ngx_memzero(&fetch->sin_, sizeof(fetch->sin_));
-
-#if (nginx_version < 1005008)
-  fetch->sin_.sin_addr.s_addr = resolver_ctx->addrs[i];
-#else
-  struct sockaddr_in* sin;
-
-  sin = reinterpret_cast<struct sockaddr_in*>(
-      resolver_ctx->addrs[i].sockaddr);
-
-  fetch->sin_.sin_family = sin->sin_family;
-  fetch->sin_.sin_addr.s_addr = sin->sin_addr.s_addr;
-#endif
-
+  fetch->sin_.sin_addr = fetch->addresses_[0].sin_addr;
   fetch->sin_.sin_family = AF_INET;
   fetch->sin_.sin_port = htons(fetch->url_.port);
 
@@ -604,7 +1057,7 @@ void NgxFetch::ResolveDoneHandler(ngx_resolver_ctx_t* resolver_ctx) {
 
 // Prepare the request data for this fetch, and hook the write event.
 int NgxFetch::InitRequest() {
-  in_ = ngx_create_temp_buf(pool_, 4096);
+  in_ = ngx_create_temp_buf(pool_, kInitialInputBufferSize);
   if (in_ == NULL) {
     return NGX_ERROR;
   }
@@ -619,10 +1072,16 @@ int NgxFetch::InitRequest() {
 
   response_handler = NgxFetch::HandleStatusLine;
   int rc = Connect();
+  while (rc == NGX_ERROR && NextAddress()) {
+    rc = Connect();
+  }
   if (rc == NGX_AGAIN || rc == NGX_OK) {
+    // HTTP/1.1 connections are persistent unless we say otherwise.
     if (connection_->keepalive()) {
       request_headers->Add(HttpAttributes::kConnection,
                            NgxConnection::ka_header);
+    } else {
+      request_headers->Add(HttpAttributes::kConnection, "close");
     }
     const char* method = request_headers->method_string();
     size_t method_len = strlen(method);
@@ -630,7 +1089,7 @@ int NgxFetch::InitRequest() {
     size = (method_len +
             1 /* for the space */ +
             url_.uri.len +
-            sizeof(" HTTP/1.0\r\n") - 1);
+            sizeof(" HTTP/1.1\r\n") - 1);
 
     for (int i = 0; i < request_headers->NumAttributes(); i++) {
       // if no explicit host header is given in the request headers,
@@ -660,7 +1119,7 @@ int NgxFetch::InitRequest() {
     out_->last = ngx_cpymem(out_->last, method, method_len);
     out_->last = ngx_cpymem(out_->last, " ", 1);
     out_->last = ngx_cpymem(out_->last, url_.uri.data, url_.uri.len);
-    out_->last = ngx_cpymem(out_->last, " HTTP/1.0\r\n", 11);
+    out_->last = ngx_cpymem(out_->last, " HTTP/1.1\r\n", 11);
 
     if (!have_host) {
       out_->last = ngx_cpymem(out_->last, "Host: ", 6);
@@ -688,11 +1147,20 @@ int NgxFetch::InitRequest() {
     return rc;
   }
   CHECK(rc == NGX_OK);
+#if (NGX_SSL)
+  if (ssl_ && connection_->c_->ssl == NULL) {
+    return SslHandshake();
+  }
+#endif
   NgxFetch::ConnectionWriteHandler(connection_->c_->write);
   return NGX_OK;
 }
 
 int NgxFetch::Connect() {
+  if (upstream_ != NULL) {
+    return ConnectUpstream();
+  }
+
   ngx_peer_connection_t pc;
   ngx_memzero(&pc, sizeof(pc));
   pc.sockaddr = (struct sockaddr*)&sin_;
@@ -705,9 +1173,27 @@ int NgxFetch::Connect() {
   pc.log = fetcher_->log_;
   pc.rcvbuf = -1;
 
+  // Talk to ourselves without TCP when we can.  TLS and the fetcher proxy
+  // need the real address.  Checked again on failover, as sin_ changes.
+  loopback_ = fetcher_->IsLoopback(sin_);
+  if (loopback_ && !ssl_ && fetcher_->proxy_.url.len == 0 &&
+      fetcher_->CanUseLoopbackSocket(sin_, HostWithoutPort())) {
+#if (NGX_HAVE_UNIX_DOMAIN)
+    pc.sockaddr = reinterpret_cast<struct sockaddr*>(
+        &fetcher_->loopback_sockaddr_);
+    pc.socklen = fetcher_->loopback_socklen_;
+#endif
+  }
 
-  connection_ = NgxConnection::Connect(&pc, message_handler(),
-                                       fetcher_->max_keepalive_requests_);
+  StringPiece ssl_name;
+  if (ssl_) {
+    ssl_name = StringPiece(reinterpret_cast<char*>(url_.host.data),
+                           url_.host.len);
+  }
+  connect_start_ms_ = ngx_current_msec;
+  connection_ = NgxConnection::Connect(&pc, ssl_name, message_handler(),
+                                       fetcher_->max_keepalive_requests_,
+                                       !retried_reused_);
   ngx_log_error(NGX_LOG_DEBUG, fetcher_->log_, 0,
                 "NgxFetch %p Connect() connection %p for [%s]",
                 this, connection_, str_url());
@@ -716,6 +1202,9 @@ int NgxFetch::Connect() {
     return NGX_ERROR;
   }
 
+  // ngx_http_parse_chunked() logs through the request's connection.
+  r_->connection = connection_->c_;
+
   connection_->c_->write->handler = NgxFetch::ConnectionWriteHandler;
   connection_->c_->read->handler = NgxFetch::ConnectionReadHandler;
   connection_->c_->data = this;
@@ -724,6 +1213,227 @@ int NgxFetch::Connect() {
   return NGX_OK;
 }
 
+StringPiece NgxFetch::HostWithoutPort() {
+  // The server{} that answers goes by the Host header we send, which
+  // InitRequest() only derives from the url if the request has none.
+  const char* host_header =
+      async_fetch_->request_headers()->Lookup1(HttpAttributes::kHost);
+  if (host_header == NULL) {
+    return StringPiece(reinterpret_cast<char*>(url_.host.data), url_.host.len);
+  }
+  StringPiece host(host_header);
+  stringpiece_ssize_type colon = host.rfind(':');
+  // "[::1]" has colons but no port.
+  if (colon != StringPiece::npos &&
+      host.find(']', colon) == StringPiece::npos) {
+    host = host.substr(0, colon);
+  }
+  return host;
+}
+
+int NgxFetch::ConnectUpstream() {
+  ngx_http_upstream_t* u = static_cast<ngx_http_upstream_t*>(
+      ngx_pcalloc(pool_, sizeof(ngx_http_upstream_t)));
+  if (u == NULL) {
+    return NGX_ERROR;
+  }
+  // The block's peer.init() sets up u->peer from the request.  Balancers
+  // that look at the client, like ip_hash, see us as 127.0.0.1.  Ones that
+  // evaluate variables, like hash, aren't supported: our request is bare.
+  r_->pool = pool_;
+  r_->upstream = u;
+  ngx_connection_t* client = static_cast<ngx_connection_t*>(
+      ngx_pcalloc(pool_, sizeof(ngx_connection_t)));
+  if (client == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_memzero(&sin_, sizeof(sin_));
+  sin_.sin_family = AF_INET;
+  sin_.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  client->sockaddr = reinterpret_cast<struct sockaddr*>(&sin_);
+  client->socklen = sizeof(sin_);
+  client->log = fetcher_->log_;
+  r_->connection = client;
+
+  u->peer.log = fetcher_->log_;
+  u->peer.log_error = NGX_ERROR_ERR;
+  if (upstream_->peer.init(r_, upstream_) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  connect_start_ms_ = ngx_current_msec;
+  connection_ = NgxConnection::ConnectUpstream(
+      u, message_handler(), fetcher_->max_keepalive_requests_);
+  ngx_log_error(NGX_LOG_DEBUG, fetcher_->log_, 0,
+                "NgxFetch %p ConnectUpstream() connection %p for [%s]",
+                this, connection_, str_url());
+  if (connection_ == NULL) {
+    return NGX_ERROR;
+  }
+
+  // The block picked the server, so only now do we know whether it's us.
+  loopback_ = u->peer.sockaddr != NULL &&
+      u->peer.sockaddr->sa_family == AF_INET &&
+      fetcher_->IsLoopback(
+          *reinterpret_cast<struct sockaddr_in*>(u->peer.sockaddr));
+
+  r_->connection = connection_->c_;
+  connection_->c_->write->handler = NgxFetch::ConnectionWriteHandler;
+  connection_->c_->read->handler = NgxFetch::ConnectionReadHandler;
+  connection_->c_->data = this;
+  return NGX_OK;
+}
+
+bool NgxFetch::NextAddress() {
+  if (addresses_.empty()) {
+    return false;
+  }
+  NgxDnsCache::MarkDown(sin_, ngx_current_msec);
+  if (next_address_ >= addresses_.size()) {
+    return false;
+  }
+  sin_.sin_addr = addresses_[next_address_++].sin_addr;
+  NgxDnsCache::RecordFailover();
+  ngx_log_error(NGX_LOG_DEBUG, log_, 0,
+                "NgxFetch %p: failing over to [%s]", this,
+                inet_ntoa(sin_.sin_addr));
+  return true;
+}
+
+bool NgxFetch::CanFailOver() {
+  if (connection_ == NULL || origin_responded_) {
+    return false;
+  }
+  if (connection_->reused()) {
+    // The origin may have read the request before it went away, so as with
+    // nginx's proxy_next_upstream, only repeat ones that are safe to.
+    RequestHeaders::Method method = async_fetch_->request_headers()->method();
+    return !retried_reused_ &&
+        (method == RequestHeaders::kGet || method == RequestHeaders::kHead);
+  }
+  return true;
+}
+
+bool NgxFetch::FailOver() {
+  if (!CanFailOver()) {
+    return false;
+  }
+  bool reused = connection_->reused();
+  connection_->set_keepalive(false);
+  connection_->Close();
+  connection_ = NULL;
+
+  int rc = NGX_ERROR;
+  if (reused) {
+    // Like nginx with its upstream keepalive cache: the origin closing an
+    // idle connection as we picked it up says nothing about the address, so
+    // don't mark it down.  Try once more on a new connection instead.
+    retried_reused_ = true;
+    rc = Connect();
+  }
+  while (rc == NGX_ERROR && NextAddress()) {
+    rc = Connect();
+  }
+  if (rc != NGX_OK) {
+    return false;
+  }
+
+  // The request we built still applies, just send it again.
+  out_->pos = out_->start;
+  response_handler = NgxFetch::HandleStatusLine;
+  r_->state = 0;
+  done_ = false;
+  write_start_ms_ = 0;
+  request_sent_ms_ = 0;
+#if (NGX_SSL)
+  if (ssl_) {
+    return SslHandshake() == NGX_OK;
+  }
+#endif
+  NgxFetch::ConnectionWriteHandler(connection_->c_->write);
+  return true;
+}
+
+#if (NGX_SSL)
+// Resume the last session we had with this origin if we can: that saves a
+// round trip and the origin's public key operation.
+int NgxFetch::SslHandshake() {
+  ngx_connection_t* c = connection_->c_;
+  // ngx_ssl_create_connection() allocates from the connection's pool, which
+  // peer connections don't have by default.  NgxConnection frees it.
+  if (c->pool == NULL) {
+    c->pool = ngx_create_pool(128, c->log);
+    if (c->pool == NULL) {
+      return NGX_ERROR;
+    }
+  }
+  if (ngx_ssl_create_connection(fetcher_->ssl_, c,
+                                NGX_SSL_BUFFER | NGX_SSL_CLIENT) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+  GoogleString host(reinterpret_cast<char*>(url_.host.data), url_.host.len);
+  if (SSL_set_tlsext_host_name(c->ssl->connection,
+                               const_cast<char*>(host.c_str())) == 0) {
+    return NGX_ERROR;
+  }
+#endif
+
+  ngx_ssl_session_t* session = fetcher_->SslSession(SslOrigin());
+  if (session != NULL && ngx_ssl_set_session(c, session) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  ngx_int_t rc = ngx_ssl_handshake(c);
+  if (rc == NGX_AGAIN) {
+    c->ssl->handler = NgxFetch::SslHandshakeHandler;
+    return NGX_OK;
+  }
+  NgxFetch::SslHandshakeHandler(c);
+  return NGX_OK;
+}
+
+// The handshake is done, one way or another.  Timer set in Init() is still in
+// effect.
+void NgxFetch::SslHandshakeHandler(ngx_connection_t* c) {
+  NgxFetch* fetch = static_cast<NgxFetch*>(c->data);
+  NgxUrlAsyncFetcher* fetcher = fetch->fetcher_;
+
+  bool handshaked = c->ssl != NULL && c->ssl->handshaked;
+  if (!handshaked) {
+    if (fetch->FailOver()) {
+      return;
+    }
+    // FailOver() may have closed c already, so leave it alone.
+    fetch->message_handler()->Message(
+        kWarning, "NgxFetch %p: TLS handshake failed for %s", fetch,
+        fetch->str_url());
+    fetch->CallbackDone(false);
+    return;
+  }
+  if (!fetcher->SslCertificateOk(c, &fetch->url_.host)) {
+    fetch->message_handler()->Message(
+        kWarning, "NgxFetch %p: TLS handshake failed for %s", fetch,
+        fetch->str_url());
+    c->error = 1;
+    fetch->CallbackDone(false);
+    return;
+  }
+
+  if (c->ssl->session_reused) {
+    fetcher->ssl_session_reuses_->Add(1);
+  } else {
+    fetcher->ssl_handshakes_->Add(1);
+  }
+
+  // ngx_ssl_handshake() took the handlers over while it waited.
+  c->write->handler = NgxFetch::ConnectionWriteHandler;
+  c->read->handler = NgxFetch::ConnectionReadHandler;
+  NgxFetch::ConnectionWriteHandler(c->write);
+}
+#endif
+
 // When the fetch sends the request completely, it will hook the read event,
 // and prepare to parse the response. Timer set in Init() is still in effect.
 void NgxFetch::ConnectionWriteHandler(ngx_event_t* wev) {
@@ -738,6 +1448,9 @@ void NgxFetch::ConnectionWriteHandler(ngx_event_t* wev) {
                   "send result %d", fetch, n);
 
     if (n >= 0) {
+      if (fetch->write_start_ms_ == 0) {
+        fetch->write_start_ms_ = ngx_current_msec;
+      }
       out->pos += n;
     } else if (n == NGX_AGAIN) {
       break;
@@ -749,6 +1462,7 @@ void NgxFetch::ConnectionWriteHandler(ngx_event_t* wev) {
 
   if (ok) {
     if (out->pos == out->last) {
+      fetch->request_sent_ms_ = ngx_current_msec;
       ok = ngx_handle_read_event(c->read, 0) == NGX_OK;
     } else {
       ok = ngx_handle_write_event(c->write, 0) == NGX_OK;
@@ -756,9 +1470,12 @@ void NgxFetch::ConnectionWriteHandler(ngx_event_t* wev) {
   }
 
   if (!ok) {
+    c->error = 1;
+    if (fetch->FailOver()) {
+      return;
+    }
     fetch->message_handler()->Message(
         kWarning, "NgxFetch %p: failed to hook next event", fetch);
-    c->error = 1;
     fetch->CallbackDone(false);
   }
 }
@@ -770,8 +1487,13 @@ void NgxFetch::ConnectionReadHandler(ngx_event_t* rev) {
   bool ok = true;
 
   while(rev->ready) {
-    int n = c->recv(
-        c, fetch->in_->start, fetch->in_->end - fetch->in_->start);
+    if (!fetch->GrowInputBuffer()) {
+      ok = false;
+      break;
+    }
+    size_t size = fetch->in_->end - fetch->in_->start;
+    int n = c->recv(c, fetch->in_->start, size);
+    fetch->last_read_filled_ = n == static_cast<int>(size);
 
     ngx_log_error(NGX_LOG_DEBUG, fetch->log_, 0,
                   "NgxFetch %p: ConnectionReadHandler "
@@ -784,22 +1506,35 @@ void NgxFetch::ConnectionReadHandler(ngx_event_t* rev) {
       // all if we at least parsed the headers.
       // If we do know the content length, having a mismatch on the bytes read
       // will be interpreted as an error.
-      ok = (fetch->content_length_known_ && fetch->content_length_ == fetch->bytes_received_)
-          || fetch->parser_.headers_complete();
+      // A chunked response is only complete once we saw its last chunk.
+      ok = !fetch->chunked_ &&
+          ((fetch->content_length_known_ &&
+            fetch->content_length_ == fetch->bytes_received_) ||
+           fetch->parser_.headers_complete());
       fetch->done_ = true;
       break;
     } else if (n > 0) {
+      if (!fetch->origin_responded_) {
+        fetch->first_byte_ms_ = ngx_current_msec;
+      }
+      fetch->origin_responded_ = true;
       fetch->in_->pos = fetch->in_->start;
       fetch->in_->last = fetch->in_->start + n;
       ok = fetch->response_handler(c);
       if (fetch->done_ || !ok) {
         break;
       }
+    } else {
+      // ngx_ssl_recv() leaves rev->ready set on errors.
+      ok = false;
+      break;
     }
   }
 
   if (!ok) {
-    fetch->CallbackDone(false);
+    if (!fetch->FailOver()) {
+      fetch->CallbackDone(false);
+    }
   } else if (fetch->done_) {
     fetch->CallbackDone(true);
   } else if (ngx_handle_read_event(rev, 0) != NGX_OK) {
@@ -854,11 +1589,35 @@ bool NgxFetch::HandleHeader(ngx_connection_t* c) {
   if (n > size) {
     return false;
   } else if (fetch->parser_.headers_complete()) {
-    // TODO(oschaaf): We should also check if the request method was HEAD
-    // - but I don't think PSOL uses that at this point.
-    if (fetch->get_status_code() == 304 || fetch->get_status_code() == 204) {
+    ResponseHeaders* response_headers =
+        fetch->async_fetch_->response_headers();
+    int status = fetch->get_status_code();
+    if (status >= 100 && status < 200 && status != 101) {
+      // An interim response, like 100 Continue or 103 Early Hints.  The
+      // real one follows, so start over on that.
+      fetch->in_->pos += n;
+      response_headers->Clear();
+      fetch->parser_.Clear();
+      fetch->r_->state = 0;
+      ngx_memzero(fetch->status_, sizeof(ngx_http_status_t));
+      fetch->set_response_handler(NgxFetch::HandleStatusLine);
+      if ((fetch->in_->last - fetch->in_->pos) > 0) {
+        return fetch->response_handler(c);
+      }
+      return true;
+    }
+    if (fetch->get_status_code() == 304 || fetch->get_status_code() == 204 ||
+        fetch->async_fetch_->request_headers()->method() ==
+            RequestHeaders::kHead) {
       fetch->done_ = true;
-    } else if (fetch->async_fetch_->response_headers()->FindContentLength(
+    } else if (response_headers->HasValue(HttpAttributes::kTransferEncoding,
+                                          "chunked")) {
+      // We pass the body on decoded, so the framing headers don't apply to
+      // it any more.  Content-Length must be ignored when both are present.
+      fetch->chunked_ = true;
+      response_headers->RemoveAll(HttpAttributes::kTransferEncoding);
+      response_headers->RemoveAll(HttpAttributes::kContentLength);
+    } else if (response_headers->FindContentLength(
             &fetch->content_length_)) {
       if (fetch->content_length_ < 0) {
         fetch->message_handler_->Message(
@@ -874,13 +1633,15 @@ bool NgxFetch::HandleHeader(ngx_connection_t* c) {
 
     if (fetch->fetcher_->track_original_content_length()
         && fetch->content_length_known_) {
-      fetch->async_fetch_->response_headers()->SetOriginalContentLength(
+      response_headers->SetOriginalContentLength(
           fetch->content_length_);
     }
 
     fetch->in_->pos += n;
     if (!fetch->done_) {
-      fetch->set_response_handler(NgxFetch::HandleBody);
+      fetch->set_response_handler(fetch->chunked_ ?
+                                  NgxFetch::HandleChunkedBody :
+                                  NgxFetch::HandleBody);
       if ((fetch->in_->last - fetch->in_->pos) > 0) {
         return fetch->response_handler(c);
       }
@@ -916,6 +1677,87 @@ bool NgxFetch::HandleBody(ngx_connection_t* c) {
   return true;
 }
 
+// Read a chunked response body, passing on only the chunk data.  nginx's own
+// chunked parser keeps its state across calls, so chunk boundaries can fall
+// anywhere in what we receive.
+bool NgxFetch::HandleChunkedBody(ngx_connection_t* c) {
+  NgxFetch* fetch = static_cast<NgxFetch*>(c->data);
+  ngx_buf_t* in = fetch->in_;
+
+  ngx_log_error(NGX_LOG_DEBUG, fetch->log_, 0,
+                "NgxFetch %p: Handle chunked body (%d bytes)", fetch,
+                in->last - in->pos);
+
+  while (in->pos < in->last) {
+    ngx_int_t rc = ngx_http_parse_chunked(fetch->r_, in,
+                                          &fetch->chunked_parser_);
+    if (rc == NGX_OK) {
+      // Chunk data starts at in->pos.
+      off_t available = in->last - in->pos;
+      size_t size = static_cast<size_t>(
+          std::min(available, fetch->chunked_parser_.size));
+      fetch->bytes_received_add(size);
+      if (!fetch->async_fetch_->Write(
+              StringPiece(reinterpret_cast<char*>(in->pos), size),
+              fetch->message_handler())) {
+        ngx_log_error(NGX_LOG_DEBUG, fetch->log_, 0,
+                      "NgxFetch %p: async fetch write failure", fetch);
+        return false;
+      }
+      in->pos += size;
+      fetch->chunked_parser_.size -= size;
+    } else if (rc == NGX_DONE) {
+      fetch->done_ = true;
+      return true;
+    } else if (rc == NGX_AGAIN) {
+      return true;
+    } else {
+      fetch->message_handler()->Message(
+          kWarning, "NgxFetch %p: invalid chunked response for %s", fetch,
+          fetch->str_url());
+      return false;
+    }
+  }
+  return true;
+}
+
+// Large responses would otherwise take a recv() and a trip through the
+// response handler per 4K.  When we know how much body is left we read that
+// much at once, otherwise we double the buffer whenever a read fills it.  The
+// handlers pass on what we read straight from in_, so a bigger buffer means
+// fewer, bigger writes too.
+bool NgxFetch::GrowInputBuffer() {
+  if (!parser_.headers_complete()) {
+    return true;
+  }
+  size_t size = in_->end - in_->start;
+  size_t wanted = size;
+  if (content_length_known_) {
+    int64 left = content_length_ - bytes_received_;
+    if (left > static_cast<int64>(size)) {
+      wanted = static_cast<size_t>(
+          std::min(left, static_cast<int64>(kMaxInputBufferSize)));
+    }
+  } else if (last_read_filled_) {
+    wanted = std::min(2 * size, kMaxInputBufferSize);
+  }
+  if (wanted <= size) {
+    return true;
+  }
+
+  ngx_buf_t* in = ngx_create_temp_buf(pool_, wanted);
+  if (in == NULL) {
+    return false;
+  }
+  // Buffers this size come from outside the pool's blocks, so this frees
+  // the old one rather than keeping it until the pool goes.
+  ngx_pfree(pool_, in_->start);
+  in_ = in;
+  ngx_log_error(NGX_LOG_DEBUG, log_, 0,
+                "NgxFetch %p: input buffer now %uz bytes", this, wanted);
+  return true;
+}
+
 void NgxFetch::TimeoutHandler(ngx_event_t* tev) {
   NgxFetch* fetch = static_cast<NgxFetch*>(tev->data);
   ngx_log_error(NGX_LOG_DEBUG, fetch->log_, 0,
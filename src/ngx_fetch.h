@@ -41,6 +41,8 @@ extern "C" {
 }
 
 #include "ngx_url_async_fetcher.h"
+#include <list>
+#include <map>
 #include <vector>
 #include "net/instaweb/http/public/url_async_fetcher.h"
 #include "pagespeed/kernel/base/basictypes.h"
@@ -57,8 +59,61 @@ typedef bool (*response_handler_pt)(ngx_connection_t* c);
 
 class NgxUrlAsyncFetcher;
 class NgxConnection;
+class Statistics;
+class UpDownCounter;
+class Variable;
 
-class NgxConnection : public PoolElement<NgxConnection> {
+// What host names resolved to, so that most fetches don't have to wait on the
+// resolver.  Failures to resolve are remembered for a little while too.  This
+// is per worker, and only used in the main thread.
+class NgxDnsCache {
+ public:
+  struct Entry {
+    // IPv4 only for now.  Empty if the name didn't resolve.
+    std::vector<struct sockaddr_in> addresses;
+    int64 expiration_ms;
+    // Which address the next fetch should start with.
+    size_t next;
+  };
+
+  static void InitStats(Statistics* statistics);
+  static void Init(Statistics* statistics);
+
+  // Returns NULL if we don't know about host, or what we know has expired.
+  static Entry* Lookup(const GoogleString& host, int64 now_ms);
+  static void Insert(const GoogleString& host,
+                     const std::vector<struct sockaddr_in>& addresses,
+                     int64 ttl_ms, int64 now_ms);
+  static void InsertNegative(const GoogleString& host, int64 now_ms);
+  // Accounts for a trip to the resolver.
+  static void RecordResolution(int64 elapsed_ms);
+
+  // Fills *ordered with addresses in the order a fetch should try them:
+  // round-robin from first, but with addresses that recently failed us last.
+  static void OrderAddresses(const std::vector<struct sockaddr_in>& addresses,
+                             size_t first, int64 now_ms,
+                             std::vector<struct sockaddr_in>* ordered);
+  // Avoid address for a while: we couldn't connect to it.
+  static void MarkDown(const struct sockaddr_in& address, int64 now_ms);
+  static void RecordFailover();
+
+ private:
+  static bool IsDown(in_addr_t address, int64 now_ms);
+
+  typedef std::map<GoogleString, Entry> EntryMap;
+  static EntryMap entries_;
+  // Until when we avoid addresses we failed to connect to.
+  static std::map<in_addr_t, int64> down_until_ms_;
+  static Variable* hits_;
+  static Variable* misses_;
+  static Variable* resolutions_;
+  static Variable* resolve_time_ms_;
+  static Variable* failovers_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxDnsCache);
+};
+
+class NgxConnection {
  public:
   NgxConnection(MessageHandler* handler, int max_keepalive_requests);
   ~NgxConnection();
@@ -74,18 +129,41 @@ class NgxConnection : public PoolElement<NgxConnection> {
   // Once keepalive is disabled, it can't be toggled back on.
   void set_keepalive(bool k) { keepalive_ = keepalive_ && k; }
   bool keepalive() { return keepalive_; }
+  // Whether we got this connection from the pool, rather than opening it.
+  bool reused() const { return reused_; }
+  // Counts this against the upstream{} server we got the connection from,
+  // once we hand the connection back.
+  void set_peer_failed() { peer_state_ = NGX_PEER_FAILED; }
+
+  typedef std::list<NgxConnection*> NgxConnectionList;
 
-  typedef Pool<NgxConnection> NgxConnectionPool;
+  static void InitStats(Statistics* statistics);
+  // Sets the limits on idle connections kept around for re-use: in total, and
+  // to any one peer.  Once a limit is hit the connection idle the longest is
+  // closed.  Called once per worker.
+  static void InitPool(Statistics* statistics, int max_idle,
+                       int max_idle_per_peer);
 
+  // Returns the most recently used idle connection to pc's peer, or opens a
+  // new one.  Connections that speak TLS are told apart by ssl_name, the host
+  // they were set up for, which is empty for plain connections.  Always opens
+  // a new one if allow_reuse is false.
   static NgxConnection* Connect(ngx_peer_connection_t* pc,
+                                StringPiece ssl_name,
                                 MessageHandler* handler,
-                                int max_keepalive_requests);
+                                int max_keepalive_requests,
+                                bool allow_reuse);
+  // Connects to the server u's upstream{} block picks, after its peer.init()
+  // has run.  The block's keepalive cache, if it has one, may hand us an open
+  // connection, and gets it back on Close() rather than our pool.
+  static NgxConnection* ConnectUpstream(ngx_http_upstream_t* u,
+                                        MessageHandler* handler,
+                                        int max_keepalive_requests);
   static void IdleWriteHandler(ngx_event_t* ev);
   static void IdleReadHandler(ngx_event_t* ev);
   // Terminate will cleanup any idle connections upon shutdown.
   static void Terminate();
 
-  static NgxConnectionPool connection_pool;
   static PthreadMutex connection_pool_mutex;
 
   // c_ is owned by NgxConnection and freed in ::Close()
@@ -94,11 +172,49 @@ class NgxConnection : public PoolElement<NgxConnection> {
   static const GoogleString ka_header;
 
  private:
+  static GoogleString PeerKey(const u_char* sockaddr, socklen_t socklen,
+                              StringPiece ssl_name) {
+    GoogleString key(reinterpret_cast<const char*>(sockaddr), socklen);
+    ssl_name.AppendToString(&key);
+    return key;
+  }
+  GoogleString PeerKey() const {
+    return PeerKey(sockaddr_, socklen_, ssl_name_);
+  }
+  // Shuts down TLS if we speak it, and closes c_.
+  void CloseSocket();
+  // Gives c_ back to the upstream{} block it came from.
+  void ReleaseToUpstream();
+  // These must be called with connection_pool_mutex held.
+  void AddToPool(std::vector<NgxConnection*>* evicted);
+  void RemoveFromPool();
+
+  // Idle connections by peer address, most recently used first.
+  static std::map<GoogleString, NgxConnectionList> idle_by_peer_;
+  // All idle connections, least recently used first.
+  static NgxConnectionList idle_lru_;
+  static int idle_count_;
+  static int max_idle_;
+  static int max_idle_per_peer_;
+  static UpDownCounter* idle_connections_;
+  static Variable* connection_reuses_;
+  static Variable* idle_evictions_;
+
   int max_keepalive_requests_;
   bool keepalive_;
   socklen_t socklen_;
   u_char sockaddr_[NGX_SOCKADDRLEN];
+  GoogleString ssl_name_;
   MessageHandler* handler_;
+  bool reused_;
+  // Set when the connection came from an upstream{} block, along with how
+  // we'll report the server to it.
+  ngx_http_upstream_t* upstream_;
+  ngx_uint_t peer_state_;
+  // Whether we're in the pool, and where.
+  bool pooled_;
+  NgxConnectionList::iterator peer_position_;
+  NgxConnectionList::iterator lru_position_;
 
   DISALLOW_COPY_AND_ASSIGN(NgxConnection);
 };
@@ -143,6 +259,14 @@ class NgxFetch : public PoolElement<NgxFetch> {
   void set_timeout_event(ngx_event_t* x) {
     timeout_event_ = x;
   }
+  // What we count against the per-origin fetch limit.
+  const GoogleString& origin() const { return origin_; }
+  void set_origin(StringPiece x) { x.CopyToString(&origin_); }
+  // Whether no one is waiting on this fetch.  Must be accessed with the
+  // fetcher's mutex held.
+  bool background() const { return background_; }
+  void set_background(bool x) { background_ = x; }
+
   void release_resolver() {
     if (resolver_ctx_ != NULL && resolver_ctx_ != NGX_NO_RESOLVER) {
       ngx_resolve_name_done(resolver_ctx_);
@@ -159,6 +283,28 @@ class NgxFetch : public PoolElement<NgxFetch> {
   int InitRequest();
   // Create the connection with remote server.
   int Connect();
+  // Create it through upstream_ instead.
+  int ConnectUpstream();
+  // The host name the origin will see, for picking its server{}.
+  StringPiece HostWithoutPort();
+  // Gives up on sin_ after failing to connect to it, and moves on to the
+  // next address the host resolved to.  Returns false if there's none left.
+  bool NextAddress();
+  // Whether a failure on connection_ means we should send the request again:
+  // the origin never got to say anything on it, and, if it came from the
+  // pool, this is the first time and the request is safe to repeat.
+  bool CanFailOver();
+  // Sends the request again.  If connection_ came from the pool the origin
+  // may just have closed it, so that's on a new connection to the same peer;
+  // otherwise it's on the next address.
+  bool FailOver();
+#if (NGX_SSL)
+  // Start TLS on a new connection, and write the request once that's done.
+  int SslHandshake();
+  static void SslHandshakeHandler(ngx_connection_t* c);
+#endif
+  // "host:port", which is what we keep TLS sessions by.
+  GoogleString SslOrigin() const;
   void set_response_handler(response_handler_pt handler) {
     response_handler = handler;
   }
@@ -174,14 +320,22 @@ class NgxFetch : public PoolElement<NgxFetch> {
   static bool HandleHeader(ngx_connection_t* c);
   // Read the response body.
   static bool HandleBody(ngx_connection_t* c);
+  // Read a response body sent with Transfer-Encoding: chunked.
+  static bool HandleChunkedBody(ngx_connection_t* c);
   // Cancel the fetch when it's timeout.
   static void TimeoutHandler(ngx_event_t* tev);
 
+  // Swaps in_ for a bigger buffer once we're reading the body and it looks
+  // like it's worth it.  Only call this when in_ holds nothing we still need.
+  bool GrowInputBuffer();
+
   // Add the pagespeed User-Agent.
   void FixUserAgent();
   void FixHost();
 
   const GoogleString str_url_;
+  GoogleString origin_;
+  bool background_;
   ngx_url_t url_;
   NgxUrlAsyncFetcher* fetcher_;
   AsyncFetch* async_fetch_;
@@ -193,6 +347,32 @@ class NgxFetch : public PoolElement<NgxFetch> {
   bool done_;
   int64 content_length_;
   bool content_length_known_;
+  // Whether the body is chunked, and where we are in decoding it.
+  bool chunked_;
+  ngx_http_chunked_t chunked_parser_;
+  // Whether this is an https fetch.
+  bool ssl_;
+  // The nginx upstream{} block we fetch through, if the host names one.
+  ngx_http_upstream_srv_conf_t* upstream_;
+  // Whether the server we last connected to is this nginx.
+  bool loopback_;
+  // When we reached each point in the fetch, in ngx_current_msec terms, or 0
+  // if we haven't yet.
+  int64 resolve_start_ms_;
+  int64 resolve_end_ms_;
+  int64 connect_start_ms_;
+  int64 write_start_ms_;
+  int64 request_sent_ms_;
+  int64 first_byte_ms_;
+  // What the host resolved to, in the order we try them, and how far we got.
+  std::vector<struct sockaddr_in> addresses_;
+  size_t next_address_;
+  // Whether we received anything on connection_.
+  bool origin_responded_;
+  // Whether a pooled connection failed on us, so we went for a new one.
+  bool retried_reused_;
+  // Whether our last read filled in_.
+  bool last_read_filled_;
 
   struct sockaddr_in sin_;
   ngx_log_t* log_;
@@ -0,0 +1,295 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+
+
+extern "C" {
+  #include <ngx_config.h>
+}
+
+#include "ngx_inflater.h"
+
+#include <zlib.h>
+
+#include <cstring>
+#include <vector>
+
+#if (NGX_PAGESPEED_BROTLI)
+#include <brotli/decode.h>
+#endif
+
+#include "base/logging.h"
+
+namespace net_instaweb {
+
+namespace {
+
+// How many released inflaters of each format we keep around per worker.
+const size_t kMaxPooledInflaters = 16;
+
+typedef std::vector<NgxInflater*> InflaterList;
+
+// Indexed by NgxInflater::Format.  Only touched from the nginx thread.
+InflaterList free_inflaters[NgxInflater::kBrotli + 1];
+
+class NgxZlibInflater : public NgxInflater {
+ public:
+  explicit NgxZlibInflater(Format format)
+      : NgxInflater(format),
+        initialized_(false),
+        error_(false),
+        raw_deflate_(false),
+        produced_output_(false) {
+    memset(&zstream_, 0, sizeof(zstream_));
+  }
+
+  virtual ~NgxZlibInflater() {
+    if (initialized_) {
+      inflateEnd(&zstream_);
+    }
+  }
+
+  virtual bool Init() {
+    CHECK(!initialized_);
+    initialized_ = (inflateInit2(&zstream_, WindowBits()) == Z_OK);
+    return initialized_;
+  }
+
+  virtual bool Reset() {
+    if (!initialized_) {
+      return false;
+    }
+    error_ = false;
+    produced_output_ = false;
+    if (raw_deflate_) {
+      // We switched to raw deflate for the previous response; go back to
+      // expecting a zlib header.
+      raw_deflate_ = false;
+      return inflateReset2(&zstream_, WindowBits()) == Z_OK;
+    }
+    return inflateReset(&zstream_) == Z_OK;
+  }
+
+  virtual bool SetInput(const char* in, size_t in_size) {
+    if (!initialized_ || error_ || zstream_.avail_in != 0) {
+      return false;
+    }
+    zstream_.next_in =
+        reinterpret_cast<Bytef*>(const_cast<char*>(in));
+    zstream_.avail_in = static_cast<uInt>(in_size);
+    return true;
+  }
+
+  virtual bool HasUnconsumedInput() const {
+    return initialized_ && !error_ && zstream_.avail_in != 0;
+  }
+
+  virtual int InflateBytes(char* buf, size_t buf_size) {
+    if (!initialized_ || error_) {
+      return -1;
+    }
+    Bytef* next_in = zstream_.next_in;
+    uInt avail_in = zstream_.avail_in;
+    zstream_.next_out = reinterpret_cast<Bytef*>(buf);
+    zstream_.avail_out = static_cast<uInt>(buf_size);
+    int result = inflate(&zstream_, Z_SYNC_FLUSH);
+    if (result == Z_DATA_ERROR && format() == kDeflate &&
+        !raw_deflate_ && !produced_output_) {
+      // Some servers send raw deflate data for Content-Encoding: deflate
+      // instead of the zlib format the spec asks for.  Retry as raw deflate.
+      raw_deflate_ = true;
+      if (inflateReset2(&zstream_, WindowBits()) != Z_OK) {
+        error_ = true;
+        return -1;
+      }
+      zstream_.next_in = next_in;
+      zstream_.avail_in = avail_in;
+      zstream_.next_out = reinterpret_cast<Bytef*>(buf);
+      zstream_.avail_out = static_cast<uInt>(buf_size);
+      result = inflate(&zstream_, Z_SYNC_FLUSH);
+    }
+    if (result == Z_STREAM_END) {
+      // Anything after the end of the stream is garbage; drop it.
+      zstream_.avail_in = 0;
+    } else if (result != Z_OK && result != Z_BUF_ERROR) {
+      error_ = true;
+      zstream_.avail_in = 0;
+      return -1;
+    }
+    int inflated = buf_size - zstream_.avail_out;
+    produced_output_ = produced_output_ || inflated > 0;
+    return inflated;
+  }
+
+ private:
+  int WindowBits() const {
+    if (format() == kGzip) {
+      return 16 + MAX_WBITS;  // Expect a gzip header.
+    }
+    return raw_deflate_ ? -MAX_WBITS : MAX_WBITS;
+  }
+
+  z_stream zstream_;
+  bool initialized_;
+  bool error_;
+  bool raw_deflate_;
+  bool produced_output_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxZlibInflater);
+};
+
+#if (NGX_PAGESPEED_BROTLI)
+
+class NgxBrotliInflater : public NgxInflater {
+ public:
+  NgxBrotliInflater()
+      : NgxInflater(kBrotli),
+        state_(NULL),
+        next_in_(NULL),
+        avail_in_(0),
+        error_(false) {}
+
+  virtual ~NgxBrotliInflater() {
+    if (state_ != NULL) {
+      BrotliDecoderDestroyInstance(state_);
+    }
+  }
+
+  virtual bool Init() {
+    CHECK(state_ == NULL);
+    state_ = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+    return state_ != NULL;
+  }
+
+  // The brotli decoder has no way to reset its state, so brotli inflaters
+  // are never pooled.
+  virtual bool Reset() { return false; }
+
+  virtual bool SetInput(const char* in, size_t in_size) {
+    if (state_ == NULL || error_ || avail_in_ != 0) {
+      return false;
+    }
+    next_in_ = reinterpret_cast<const uint8_t*>(in);
+    avail_in_ = in_size;
+    return true;
+  }
+
+  virtual bool HasUnconsumedInput() const {
+    if (state_ == NULL || error_) {
+      return false;
+    }
+    return avail_in_ != 0 || BrotliDecoderHasMoreOutput(state_);
+  }
+
+  virtual int InflateBytes(char* buf, size_t buf_size) {
+    if (state_ == NULL || error_) {
+      return -1;
+    }
+    uint8_t* next_out = reinterpret_cast<uint8_t*>(buf);
+    size_t avail_out = buf_size;
+    BrotliDecoderResult result = BrotliDecoderDecompressStream(
+        state_, &avail_in_, &next_in_, &avail_out, &next_out, NULL);
+    if (result == BROTLI_DECODER_RESULT_ERROR) {
+      error_ = true;
+      avail_in_ = 0;
+      return -1;
+    }
+    if (result == BROTLI_DECODER_RESULT_SUCCESS) {
+      // Anything after the end of the stream is garbage; drop it like zlib
+      // does rather than spinning on it.
+      avail_in_ = 0;
+    }
+    return buf_size - avail_out;
+  }
+
+ private:
+  BrotliDecoderState* state_;
+  const uint8_t* next_in_;
+  size_t avail_in_;
+  bool error_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxBrotliInflater);
+};
+
+#endif  // NGX_PAGESPEED_BROTLI
+
+NgxInflater* NewInflater(NgxInflater::Format format) {
+  switch (format) {
+    case NgxInflater::kGzip:
+    case NgxInflater::kDeflate:
+      return new NgxZlibInflater(format);
+    case NgxInflater::kBrotli:
+#if (NGX_PAGESPEED_BROTLI)
+      return new NgxBrotliInflater();
+#else
+      return NULL;
+#endif
+  }
+  return NULL;
+}
+
+}  // namespace
+
+NgxInflater* NgxInflater::Acquire(StringPiece content_encoding) {
+  Format format;
+  if (StringCaseEqual(content_encoding, "gzip")) {
+    format = kGzip;
+  } else if (StringCaseEqual(content_encoding, "deflate")) {
+    format = kDeflate;
+  } else if (StringCaseEqual(content_encoding, "br")) {
+    format = kBrotli;
+  } else {
+    return NULL;
+  }
+
+  InflaterList* free_list = &free_inflaters[format];
+  if (!free_list->empty()) {
+    NgxInflater* inflater = free_list->back();
+    free_list->pop_back();
+    return inflater;
+  }
+
+  NgxInflater* inflater = NewInflater(format);
+  if (inflater != NULL && !inflater->Init()) {
+    delete inflater;
+    inflater = NULL;
+  }
+  return inflater;
+}
+
+void NgxInflater::Release(NgxInflater* inflater) {
+  InflaterList* free_list = &free_inflaters[inflater->format()];
+  if (free_list->size() < kMaxPooledInflaters && inflater->Reset()) {
+    free_list->push_back(inflater);
+  } else {
+    delete inflater;
+  }
+}
+
+void NgxInflater::ShutDown() {
+  for (size_t i = 0; i < arraysize(free_inflaters); ++i) {
+    for (size_t j = 0; j < free_inflaters[i].size(); ++j) {
+      delete free_inflaters[i][j];
+    }
+    free_inflaters[i].clear();
+  }
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,94 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+
+//
+// NgxInflater is a streaming decompressor for upstream html responses that
+// arrive with a Content-Encoding we can undo before handing the bytes to
+// ProxyFetch.  gzip and deflate are backed by zlib; br is available when the
+// brotli decoder library was found at configure time.
+//
+// Inflaters are handed out from a small per-worker free list, so that the
+// zlib window and state allocated by Init() can be reused across requests.
+// Acquire() and Release() must only be called from the nginx thread.
+
+#ifndef NGX_INFLATER_H_
+#define NGX_INFLATER_H_
+
+#include <cstddef>
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/string_util.h"
+
+namespace net_instaweb {
+
+class NgxInflater {
+ public:
+  enum Format {
+    kGzip,
+    kDeflate,
+    kBrotli,
+  };
+
+  explicit NgxInflater(Format format) : format_(format) {}
+  virtual ~NgxInflater() {}
+
+  // Returns an initialized inflater that can decode content_encoding, reusing
+  // a released one if possible.  Returns NULL if we don't know how to decode
+  // content_encoding or if initialization failed.
+  static NgxInflater* Acquire(StringPiece content_encoding);
+
+  // Hands an inflater obtained from Acquire() back to the free list, or
+  // deletes it if it can't be reset or the free list is full.
+  static void Release(NgxInflater* inflater);
+
+  // Deletes all inflaters on the free list.
+  static void ShutDown();
+
+  Format format() const { return format_; }
+
+  // Sets up the decoder state.  Returns false on failure.
+  virtual bool Init() = 0;
+
+  // Returns the decoder to the state it was in right after Init(), keeping
+  // its allocations.  Returns false if this isn't supported or failed.
+  virtual bool Reset() = 0;
+
+  // Hands the next chunk of compressed input to the decoder.  The input must
+  // stay valid until HasUnconsumedInput() returns false.
+  virtual bool SetInput(const char* in, size_t in_size) = 0;
+
+  // True while there is input left to consume, or decoded output that didn't
+  // fit into the last InflateBytes() call.
+  virtual bool HasUnconsumedInput() const = 0;
+
+  // Decodes up to buf_size bytes into buf.  Returns the number of bytes
+  // written, or -1 on a decoding error.
+  virtual int InflateBytes(char* buf, size_t buf_size) = 0;
+
+ private:
+  const Format format_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxInflater);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_INFLATER_H_
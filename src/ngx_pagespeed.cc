@@ -28,17 +28,21 @@
 
 #include "ngx_pagespeed.h"
 
+#include <algorithm>
 #include <vector>
 #include <set>
 
 #include "ngx_base_fetch.h"
 #include "ngx_caching_headers.h"
 #include "ngx_gzip_setter.h"
+#include "ngx_inflater.h"
 #include "ngx_list_iterator.h"
 #include "ngx_message_handler.h"
+#include "ngx_response_cache.h"
 #include "ngx_rewrite_driver_factory.h"
 #include "ngx_rewrite_options.h"
 #include "ngx_server_context.h"
+#include "ngx_shared_url_table.h"
 
 #include "net/instaweb/http/public/async_fetch.h"
 #include "net/instaweb/http/public/cache_url_async_fetcher.h"
@@ -67,9 +71,9 @@
 #include "pagespeed/kernel/http/content_type.h"
 #include "pagespeed/kernel/http/google_url.h"
 #include "pagespeed/kernel/http/query_params.h"
+#include "pagespeed/kernel/http/user_agent_matcher.h"
 #include "pagespeed/kernel/html/html_keywords.h"
 #include "pagespeed/kernel/thread/pthread_shared_mem.h"
-#include "pagespeed/kernel/util/gzip_inflater.h"
 #include "pagespeed/kernel/util/statistics_logger.h"
 #include "pagespeed/system/in_place_resource_recorder.h"
 #include "pagespeed/system/system_caches.h"
@@ -94,6 +98,15 @@ net_instaweb::NgxRewriteDriverFactory* active_driver_factory = NULL;
 namespace net_instaweb {
 
 const char* kInternalEtagName = "@psol-etag";
+// Size of the per-worker scratch buffer compressed html is inflated into.
+const size_t kInflateBufferSize = 64 * 1024;
+// Size of the per-worker scratch buffer IPRO reads file-backed responses into.
+const size_t kInPlaceReadBufferSize = 64 * 1024;
+// How long a worker's claim on recording a url for IPRO lasts if it's never
+// released, for instance because the worker died mid-recording.
+const int64 kIproRecordingClaimMs = 5 * Timer::kMinuteMs;
+// Largest .pagespeed. resource we hold on to for the sendfile resource store.
+const size_t kResourceFileMaxBytes = 16 * 1024 * 1024;
 // The process context takes care of proactively initialising
 // a few libraries for us, some of which are not thread-safe
 // when they are initialized lazily.
@@ -229,9 +242,22 @@ void ps_set_buffered(ngx_http_request_t* r, bool on) {
   }
 }
 
+// Let nginx's range filter answer Range and If-Range requests for a complete
+// response we produce ourselves.  Unless the whole body goes out in a single
+// buffer, nginx can only cut one range out of it.
+void ps_allow_ranges(ngx_http_request_t* r, bool single_range) {
+  r->allow_ranges = 1;
+  r->single_range = single_range;
+}
+
 namespace {
 
 void ps_release_base_fetch(ps_request_ctx_t* ctx);
+void ps_html_output_cache_insert(ngx_http_request_t* r, ps_request_ctx_t* ctx);
+void ps_resource_capture_done(ngx_http_request_t* r, ps_request_ctx_t* ctx);
+void ps_resource_validators_insert(ngx_http_request_t* r,
+                                   ps_request_ctx_t* ctx);
+void ps_html_rewrite_deadline_cancel(ps_request_ctx_t* ctx);
 
 }  // namespace
 
@@ -266,6 +292,39 @@ ngx_int_t ps_base_fetch_filter(ngx_http_request_t* r, ngx_chain_t* in) {
   return NGX_AGAIN;
 }
 
+// Drops the response headers nginx has so far, so that they can be replaced
+// by the ones pagespeed produced.  Caching headers are kept as
+// preserve_caching_headers asks.
+void ps_clear_headers_out(ngx_http_request_t* r,
+                          PreserveCachingHeaders preserve_caching_headers) {
+  if (preserve_caching_headers != kDontPreserveHeaders) {
+    ngx_table_elt_t* header;
+    NgxListIterator it(&(r->headers_out.headers.part));
+    while ((header = it.Next()) != NULL) {
+      // We need to remember a few headers when ModifyCachingHeaders is off,
+      // so we can send them unmodified in copy_response_headers_to_ngx().
+      // This just sets the hash to 0 for all other headers. That way, we
+      // avoid  some relatively complicated code to reconstruct these headers.
+      if (!(STR_CASE_EQ_LITERAL(header->key, "Cache-Control") ||
+            (preserve_caching_headers == kPreserveAllCachingHeaders &&
+             (STR_CASE_EQ_LITERAL(header->key, "Etag") ||
+              STR_CASE_EQ_LITERAL(header->key, "Date") ||
+              STR_CASE_EQ_LITERAL(header->key, "Last-Modified") ||
+              STR_CASE_EQ_LITERAL(header->key, "Expires"))))) {
+        header->hash = 0;
+        if (STR_CASE_EQ_LITERAL(header->key, "Location")) {
+          // There's a possible issue with the location header, where setting
+          // the hash to 0 is not enough. See:
+          // https://github.com/nginx/nginx/blob/master/src/http/ngx_http_header_filter_module.c#L314
+          r->headers_out.location = NULL;
+        }
+      }
+    }
+  } else {
+    ngx_http_clean_header(r);
+  }
+}
+
 // This runs on the nginx event loop in response to seeing the byte PageSpeed
 // sent over the pipe to trigger the nginx-side code.  Copy whatever is ready
 // from PageSpeed out to the browser (headers and/or body).
@@ -299,32 +358,7 @@ ngx_int_t ps_base_fetch_handler(ngx_http_request_t* r) {
       return NGX_DONE;
     }
 
-    if (ctx->preserve_caching_headers != kDontPreserveHeaders) {
-      ngx_table_elt_t* header;
-      NgxListIterator it(&(r->headers_out.headers.part));
-      while ((header = it.Next()) != NULL) {
-        // We need to remember a few headers when ModifyCachingHeaders is off,
-        // so we can send them unmodified in copy_response_headers_to_ngx().
-        // This just sets the hash to 0 for all other headers. That way, we
-        // avoid  some relatively complicated code to reconstruct these headers.
-        if (!(STR_CASE_EQ_LITERAL(header->key, "Cache-Control") ||
-              (ctx->preserve_caching_headers == kPreserveAllCachingHeaders &&
-               (STR_CASE_EQ_LITERAL(header->key, "Etag") ||
-                STR_CASE_EQ_LITERAL(header->key, "Date") ||
-                STR_CASE_EQ_LITERAL(header->key, "Last-Modified") ||
-                STR_CASE_EQ_LITERAL(header->key, "Expires"))))) {
-          header->hash = 0;
-          if (STR_CASE_EQ_LITERAL(header->key, "Location")) {
-            // There's a possible issue with the location header, where setting
-            // the hash to 0 is not enough. See:
-            // https://github.com/nginx/nginx/blob/master/src/http/ngx_http_header_filter_module.c#L314
-            r->headers_out.location = NULL;
-          }
-        }
-      }
-    } else {
-      ngx_http_clean_header(r);
-    }
+    ps_clear_headers_out(r, ctx->preserve_caching_headers);
     // collect response headers from pagespeed
     rc = ctx->base_fetch->CollectHeaders(&r->headers_out);
     if (rc == NGX_ERROR) {
@@ -332,6 +366,14 @@ ngx_int_t ps_base_fetch_handler(ngx_http_request_t* r) {
       return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
+    // Optimized resources and IPRO hits are served from the cached
+    // representation, so partial requests can be answered from it too.
+    if (status_code == HttpStatus::kOK &&
+        (ctx->base_fetch->base_fetch_type() == kPageSpeedResource ||
+         ctx->base_fetch->base_fetch_type() == kIproLookup)) {
+      ps_allow_ranges(r, true /* single_range */);
+    }
+
     // send response headers
     rc = ngx_http_next_header_filter(r);
 
@@ -341,6 +383,9 @@ ngx_int_t ps_base_fetch_handler(ngx_http_request_t* r) {
       return ngx_http_filter_finalize_request(r, NULL, rc);
     }
 
+    // Pagespeed's headers are out, so the original html can't follow them.
+    ps_html_rewrite_deadline_cancel(ctx);
+
     // for in_place_check_header_filter
     if (rc < NGX_OK && rc != NGX_AGAIN) {
       CHECK(rc == NGX_DONE);
@@ -371,8 +416,21 @@ ngx_int_t ps_base_fetch_handler(ngx_http_request_t* r) {
     return NGX_AGAIN;
   }
 
+  // Once rewritten html is on its way we can't switch to the original any
+  // more.
+  ps_html_rewrite_deadline_cancel(ctx);
+
   if (rc == NGX_OK) {
     ps_set_buffered(r, false);
+    if (ctx->html_output_capture != NULL) {
+      ps_html_output_cache_insert(r, ctx);
+    }
+    if (!ctx->resource_cache_key.empty()) {
+      ps_resource_capture_done(r, ctx);
+    }
+    if (ctx->record_resource_validators) {
+      ps_resource_validators_insert(r, ctx);
+    }
     ps_release_base_fetch(ctx);
   }
 
@@ -1722,6 +1780,16 @@ void ps_create_base_fetch(StringPiece url,
   ctx->base_fetch->SetRequestHeadersTakingOwnership(request_headers);
 }
 
+// Lets other workers record the url this request was recording for IPRO.
+void ps_release_ipro_recording(ps_request_ctx_t* ctx) {
+  if (ctx->ipro_recording_key != 0) {
+    ps_srv_conf_t* cfg_s = ps_get_srv_config(ctx->r);
+    cfg_s->server_context->ngx_rewrite_driver_factory()->ipro_recordings()->
+        Erase(ctx->ipro_recording_key, ctx->ipro_recording_expiration_ms);
+    ctx->ipro_recording_key = 0;
+  }
+}
+
 void ps_release_request_context(void* data) {
   ps_request_ctx_t* ctx = static_cast<ps_request_ctx_t*>(data);
 
@@ -1735,7 +1803,7 @@ void ps_release_request_context(void* data) {
   }
 
   if (ctx->inflater_ != NULL) {
-    delete ctx->inflater_;
+    NgxInflater::Release(ctx->inflater_);
     ctx->inflater_ = NULL;
   }
 
@@ -1749,11 +1817,647 @@ void ps_release_request_context(void* data) {
     ctx->recorder->DoneAndSetHeaders(NULL, false /* incomplete response */);
     ctx->recorder = NULL;
   }
+  ps_release_ipro_recording(ctx);
+
+  if (ctx->html_output_capture != NULL) {
+    delete ctx->html_output_capture;
+    ctx->html_output_capture = NULL;
+  }
+
+  if (ctx->resource_capture != NULL) {
+    delete ctx->resource_capture;
+    ctx->resource_capture = NULL;
+  }
+
+  if (ctx->html_rewrite_deadline.timer_set) {
+    ngx_del_timer(&ctx->html_rewrite_deadline);
+  }
+  if (ctx->html_original != NULL) {
+    delete ctx->html_original;
+    ctx->html_original = NULL;
+  }
 
   ps_release_base_fetch(ctx);
   delete ctx;
 }
 
+// Called once we know we're going to send pagespeed's html, so there's no
+// need to keep the original around.
+void ps_html_rewrite_deadline_cancel(ps_request_ctx_t* ctx) {
+  if (ctx->html_rewrite_deadline.timer_set) {
+    ngx_del_timer(&ctx->html_rewrite_deadline);
+  }
+  if (!ctx->html_rewrite_timed_out && ctx->html_original != NULL) {
+    delete ctx->html_original;
+    ctx->html_original = NULL;
+  }
+}
+
+// Whether the response can be served from a cache keyed on the url and on
+// whether the client accepts gzip.
+bool ps_varies_only_on_accept_encoding(
+    const ResponseHeaders& response_headers) {
+  ConstStringStarVector values;
+  if (response_headers.Lookup(HttpAttributes::kVary, &values)) {
+    for (int i = 0, n = values.size(); i < n; ++i) {
+      if (values[i] != NULL &&
+          !StringCaseEqual(*values[i], HttpAttributes::kAcceptEncoding)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Whether options enable filters that put beacons in the html.  Those carry a
+// nonce per page view, so their output must not be replayed.
+bool ps_html_output_has_beacons(const RewriteOptions* options) {
+  if (options->Enabled(RewriteOptions::kAddInstrumentation) ||
+      options->Enabled(RewriteOptions::kPrioritizeCriticalCss)) {
+    return true;
+  }
+  return options->critical_images_beacon_enabled() &&
+      (options->Enabled(RewriteOptions::kDelayImages) ||
+       options->Enabled(RewriteOptions::kLazyloadImages) ||
+       options->Enabled(RewriteOptions::kInlineImages) ||
+       options->Enabled(RewriteOptions::kResizeToRenderedImageDimensions));
+}
+
+// Returns the key the rewritten html for this request is stored under in the
+// html output cache, or an empty string if the request or the upstream
+// response make it ineligible for caching.  Only anonymous GETs are eligible,
+// and only responses that are publicly cacheable and carry a validator.  The
+// validator is part of the key, so a changed upstream response never matches
+// an old entry.
+GoogleString ps_html_output_cache_key(ngx_http_request_t* r,
+                                      ps_srv_conf_t* cfg_s,
+                                      const RewriteOptions* options,
+                                      StringPiece url,
+                                      const RequestHeaders& request_headers,
+                                      const ResponseHeaders& response_headers) {
+  if (ps_html_output_has_beacons(options)) {
+    return "";
+  }
+
+  if (r->method != NGX_HTTP_GET ||
+      r->headers_out.status != NGX_HTTP_OK ||
+      request_headers.Has(HttpAttributes::kCookie) ||
+      request_headers.Has(HttpAttributes::kAuthorization) ||
+      response_headers.Has(HttpAttributes::kSetCookie) ||
+      response_headers.HasValue(HttpAttributes::kCacheControl, "private") ||
+      response_headers.HasValue(HttpAttributes::kCacheControl, "no-store")) {
+    return "";
+  }
+
+  if (!ps_varies_only_on_accept_encoding(response_headers)) {
+    return "";
+  }
+
+  const char* validator = response_headers.Lookup1(HttpAttributes::kEtag);
+  if (validator == NULL) {
+    validator = response_headers.Lookup1(HttpAttributes::kLastModified);
+  }
+  if (validator == NULL || *validator == '\0') {
+    return "";
+  }
+
+  // The rewritten html depends on the user agent through the device type and
+  // through webp support.
+  const char* user_agent = request_headers.Lookup1(HttpAttributes::kUserAgent);
+  UserAgentMatcher::DeviceType device_type =
+      cfg_s->server_context->user_agent_matcher()->GetDeviceTypeForUA(
+          user_agent == NULL ? "" : user_agent);
+  bool accepts_webp = false;
+  ConstStringStarVector values;
+  if (request_headers.Lookup(HttpAttributes::kAccept, &values)) {
+    for (int i = 0, n = values.size(); i < n; ++i) {
+      if (values[i] != NULL &&
+          values[i]->find("image/webp") != GoogleString::npos) {
+        accepts_webp = true;
+      }
+    }
+  }
+
+  return StrCat(url, "\n", IntegerToString(device_type),
+                accepts_webp ? " webp\n" : "\n",
+                IntegerToString(options->experiment_id()), "\n", validator);
+}
+
+// Looks the request up in the html output cache.  On a hit this prepares the
+// cached body for ps_html_rewrite_body_filter and returns true.  On a miss it
+// remembers the key, so that ps_html_output_cache_insert() can store the
+// response once pagespeed is done with it.
+bool ps_html_output_cache_lookup(ngx_http_request_t* r,
+                                 ps_request_ctx_t* ctx,
+                                 ps_srv_conf_t* cfg_s,
+                                 const RewriteOptions* options,
+                                 StringPiece url,
+                                 const RequestHeaders& request_headers,
+                                 const ResponseHeaders& response_headers) {
+  NgxServerContext* server_context = cfg_s->server_context;
+  NgxResponseCache* cache = server_context->html_output_cache();
+  GoogleString key = ps_html_output_cache_key(
+      r, cfg_s, options, url, request_headers, response_headers);
+  if (key.empty()) {
+    return false;
+  }
+
+  // Let browser reloads refresh the entry.
+  if (!request_headers.HasValue(HttpAttributes::kCacheControl, "no-cache") &&
+      !request_headers.HasValue(HttpAttributes::kPragma, "no-cache")) {
+    const NgxResponseCache::Entry* entry =
+        cache->Lookup(key, server_context->timer()->NowMs());
+    if (entry != NULL &&
+        !options->IsUrlCacheValid(url, entry->insert_time_ms,
+                                  true /* search_wildcards */)) {
+      // Flushed or purged since we stored it.
+      cache->Delete(key);
+      entry = NULL;
+    }
+    if (entry != NULL) {
+      ngx_chain_t* out = NULL;
+      if (string_piece_to_buffer_chain(
+              r->pool, entry->body, &out, true /* send_last_buf */,
+              false /* send_flush */) != NGX_OK) {
+        return false;
+      }
+      // The upstream body is going to be dropped, so none of its framing
+      // applies any more.
+      if (r->headers_out.content_encoding != NULL) {
+        r->headers_out.content_encoding->hash = 0;
+        r->headers_out.content_encoding = NULL;
+      }
+      ctx->location_field_set = r->headers_out.location != NULL;
+      ps_base_fetch::ps_clear_headers_out(r, ctx->preserve_caching_headers);
+      if (copy_response_headers_to_ngx(r, entry->headers,
+                                       ctx->preserve_caching_headers)
+          != NGX_OK) {
+        return false;
+      }
+      ngx_http_clear_content_length(r);
+      r->headers_out.content_length_n = entry->body.size();
+      ctx->html_output_cache_hit = true;
+      ctx->html_output_cache_out = out;
+      server_context->html_output_cache_hits()->Add(1);
+      return true;
+    }
+  }
+
+  server_context->html_output_cache_misses()->Add(1);
+  ctx->html_output_cache_key = key;
+  return false;
+}
+
+// Called when pagespeed is done producing the rewritten html for a request
+// that missed the html output cache.  Until pagespeed's own caches are warm
+// its output changes from one request to the next, as rewrites complete.  So
+// we only store output once two misses in a row produced the same bytes; the
+// first of them leaves a digest of its output under a key of its own.
+void ps_html_output_cache_insert(ngx_http_request_t* r,
+                                 ps_request_ctx_t* ctx) {
+  ps_srv_conf_t* cfg_s = ps_get_srv_config(r);
+  NgxServerContext* server_context = cfg_s->server_context;
+  NgxResponseCache* cache = server_context->html_output_cache();
+  const ResponseHeaders* headers = ctx->base_fetch->response_headers();
+
+  // Cookies pagespeed set, like the experiment's, are for this visitor only.
+  if (cache != NULL &&
+      !ctx->base_fetch->capture_overflowed() &&
+      headers->status_code() == HttpStatus::kOK &&
+      !headers->Has(HttpAttributes::kSetCookie)) {
+    int64 now_ms = server_context->timer()->NowMs();
+    int64 ttl_ms = server_context->config()->html_output_cache_ttl_sec() *
+        Timer::kSecondMs;
+    GoogleString digest_key = StrCat(ctx->html_output_cache_key, "\ndigest");
+    GoogleString digest =
+        server_context->hasher()->Hash(*ctx->html_output_capture);
+    const NgxResponseCache::Entry* previous =
+        cache->Lookup(digest_key, now_ms);
+    if (previous != NULL && previous->body == digest) {
+      cache->Delete(digest_key);
+      if (cache->Insert(ctx->html_output_cache_key, *headers,
+                        *ctx->html_output_capture, now_ms, now_ms + ttl_ms)) {
+        server_context->html_output_cache_inserts()->Add(1);
+      }
+    } else {
+      cache->Insert(digest_key, *headers, digest, now_ms, now_ms + ttl_ms);
+    }
+  }
+
+  delete ctx->html_output_capture;
+  ctx->html_output_capture = NULL;
+}
+
+// Fills in headers_out.last_modified_time from the Last-Modified header, which
+// is what nginx matches If-Modified-Since and date If-Range requests against.
+void ps_set_last_modified_time(ngx_http_request_t* r) {
+  ngx_table_elt_t* last_modified = r->headers_out.last_modified;
+  if (last_modified != NULL) {
+    r->headers_out.last_modified_time = ngx_parse_http_time(
+        last_modified->value.data, last_modified->value.len);
+  }
+}
+
+// Returns the key a .pagespeed. resource is stored under in the resource hot
+// cache and the sendfile resource store.  The url carries the content hash, so
+// the only other thing the response can depend on is whether we were allowed
+// to gzip it.
+GoogleString ps_resource_cache_key(StringPiece url,
+                                   const RequestHeaders& request_headers) {
+  return StrCat(url, request_headers.AcceptsGzip() ? "\ngzip" : "\n");
+}
+
+// Serves a .pagespeed. resource straight from the resource hot cache, without
+// involving a PageSpeed thread.  Returns NGX_DECLINED on a miss, otherwise the
+// result of sending the response.
+ngx_int_t ps_resource_hot_cache_lookup(ngx_http_request_t* r,
+                                       NgxServerContext* server_context,
+                                       const RewriteOptions* options,
+                                       StringPiece url,
+                                       const GoogleString& key) {
+  NgxResponseCache* cache = server_context->resource_hot_cache();
+  int64 now_ms = server_context->timer()->NowMs();
+  const NgxResponseCache::Entry* entry = cache->Lookup(key, now_ms);
+  if (entry != NULL &&
+      !options->IsUrlCacheValid(url, entry->insert_time_ms,
+                                true /* search_wildcards */)) {
+    // Flushed or purged since we stored it.
+    cache->Delete(key);
+    entry = NULL;
+  }
+  if (entry == NULL) {
+    server_context->resource_hot_cache_misses()->Add(1);
+    return NGX_DECLINED;
+  }
+  server_context->resource_hot_cache_hits()->Add(1);
+
+  ResponseHeaders response_headers;
+  response_headers.CopyFrom(entry->headers);
+  response_headers.FixDateHeaders(now_ms);
+
+  if (copy_response_headers_to_ngx(r, response_headers, kDontPreserveHeaders)
+      != NGX_OK) {
+    return NGX_ERROR;
+  }
+  ngx_http_clear_content_length(r);
+  r->headers_out.content_length_n = entry->body.size();
+  ps_set_last_modified_time(r);
+  ps_allow_ranges(r, true /* single_range */);
+
+  ngx_int_t rc = ngx_http_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+    return rc;
+  }
+
+  ngx_chain_t* out;
+  if (string_piece_to_buffer_chain(r->pool, entry->body, &out,
+                                   true /* send_last_buf */,
+                                   false /* send_flush */) != NGX_OK) {
+    return NGX_ERROR;
+  }
+  return ngx_http_output_filter(r, out);
+}
+
+// Serves a .pagespeed. resource from the sendfile resource store: the headers
+// from memory, and the body as a file buffer, so that it goes out with
+// sendfile where nginx can use it.  Descriptors come from the location's
+// open_file_cache.  Returns NGX_DECLINED on a miss, otherwise the result of
+// sending the response.
+ngx_int_t ps_resource_file_lookup(ngx_http_request_t* r,
+                                  NgxServerContext* server_context,
+                                  const RewriteOptions* options,
+                                  StringPiece url,
+                                  const GoogleString& key) {
+  NgxResponseCache* cache = server_context->resource_files();
+  int64 now_ms = server_context->timer()->NowMs();
+  const NgxResponseCache::Entry* entry = cache->Lookup(key, now_ms);
+  if (entry != NULL &&
+      !options->IsUrlCacheValid(url, entry->insert_time_ms,
+                                true /* search_wildcards */)) {
+    cache->Delete(key);
+    entry = NULL;
+  }
+  if (entry == NULL) {
+    return NGX_DECLINED;
+  }
+
+  ngx_http_core_loc_conf_t* clcf = static_cast<ngx_http_core_loc_conf_t*>(
+      ngx_http_get_module_loc_conf(r, ngx_http_core_module));
+  ngx_open_file_info_t of;
+  ngx_memzero(&of, sizeof(of));
+  of.read_ahead = clcf->read_ahead;
+  of.directio = clcf->directio;
+  of.valid = clcf->open_file_cache_valid;
+  of.min_uses = clcf->open_file_cache_min_uses;
+  of.errors = clcf->open_file_cache_errors;
+  of.events = clcf->open_file_cache_events;
+
+  // The path has to be nul terminated and outlive the request.
+  ngx_str_t path;
+  path.len = entry->body.size();
+  path.data = static_cast<u_char*>(ngx_pnalloc(r->pool, path.len + 1));
+  if (path.data == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_memcpy(path.data, entry->body.data(), path.len);
+  path.data[path.len] = '\0';
+
+  if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool)
+      != NGX_OK || !of.is_file || of.size == 0) {
+    // The file cache cleaner got to it.
+    cache->Delete(key);
+    return NGX_DECLINED;
+  }
+  server_context->resource_sendfile_hits()->Add(1);
+
+  ResponseHeaders response_headers;
+  response_headers.CopyFrom(entry->headers);
+  response_headers.FixDateHeaders(now_ms);
+
+  if (copy_response_headers_to_ngx(r, response_headers, kDontPreserveHeaders)
+      != NGX_OK) {
+    return NGX_ERROR;
+  }
+  ngx_http_clear_content_length(r);
+  r->headers_out.content_length_n = of.size;
+  ps_set_last_modified_time(r);
+  ps_allow_ranges(r, false /* single_range */);
+
+  ngx_int_t rc = ngx_http_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+    return rc;
+  }
+
+  ngx_buf_t* b = static_cast<ngx_buf_t*>(ngx_calloc_buf(r->pool));
+  if (b == NULL) {
+    return NGX_ERROR;
+  }
+  b->file = static_cast<ngx_file_t*>(ngx_pcalloc(r->pool, sizeof(ngx_file_t)));
+  if (b->file == NULL) {
+    return NGX_ERROR;
+  }
+  b->file_pos = 0;
+  b->file_last = of.size;
+  b->in_file = 1;
+  b->last_buf = 1;
+  b->last_in_chain = 1;
+  b->file->fd = of.fd;
+  b->file->name = path;
+  b->file->log = r->connection->log;
+  b->file->directio = of.is_directio;
+
+  ngx_chain_t out;
+  out.buf = b;
+  out.next = NULL;
+  return ngx_http_output_filter(r, &out);
+}
+
+// Moves a .pagespeed. resource, which pagespeed already wrote to spill_file,
+// into the sendfile resource store.  Files are named after the key, so all
+// workers share them, and they live under the FileCachePath, so the file cache
+// cleaner keeps them within its size limit.  The rename replaces any older
+// file for the key atomically, so its contents always match the headers.
+void ps_resource_file_insert(NgxServerContext* server_context,
+                             const GoogleString& key,
+                             const ResponseHeaders& headers,
+                             const GoogleString& spill_file,
+                             int64 now_ms) {
+  GoogleString path = StrCat(server_context->resource_files_dir(), "/",
+                             server_context->hasher()->Hash(key));
+  FileSystem* file_system = server_context->file_system();
+  MessageHandler* handler = server_context->message_handler();
+  if (!file_system->RenameFile(spill_file.c_str(), path.c_str(), handler)) {
+    file_system->RemoveFile(spill_file.c_str(), handler);
+    return;
+  }
+  if (server_context->resource_files()->Insert(
+          key, headers, path, now_ms, headers.CacheExpirationTimeMs())) {
+    server_context->resource_sendfile_inserts()->Add(1);
+  }
+}
+
+// Whether a .pagespeed. resource response may be answered for again without
+// asking PageSpeed: a publicly cacheable 200 that is the same for every client
+// that accepts the same encodings.
+bool ps_resource_is_shareable(ResponseHeaders* headers, int64 now_ms) {
+  headers->ComputeCaching();
+  return headers->status_code() == HttpStatus::kOK &&
+      headers->IsBrowserCacheable() &&
+      !headers->HasValue(HttpAttributes::kCacheControl, "private") &&
+      !headers->Has(HttpAttributes::kSetCookie) &&
+      ps_varies_only_on_accept_encoding(*headers) &&
+      headers->CacheExpirationTimeMs() > now_ms;
+}
+
+// Called when PageSpeed is done serving a .pagespeed. resource that missed the
+// resource hot cache and the sendfile resource store.  Only complete, publicly
+// cacheable responses are kept, and never for longer than they say they may be
+// cached.  Large ones go to the sendfile resource store, which pagespeed has
+// already spilled them to disk for, small ones to the resource hot cache.
+void ps_resource_capture_done(ngx_http_request_t* r, ps_request_ctx_t* ctx) {
+  ps_srv_conf_t* cfg_s = ps_get_srv_config(r);
+  NgxServerContext* server_context = cfg_s->server_context;
+  NgxResponseCache* hot_cache = server_context->resource_hot_cache();
+  GoogleString spill_file = ctx->base_fetch->TakeSpillFile();
+
+  ResponseHeaders headers;
+  headers.CopyFrom(*ctx->base_fetch->response_headers());
+  int64 now_ms = server_context->timer()->NowMs();
+  if (ps_resource_is_shareable(&headers, now_ms)) {
+    if (!spill_file.empty()) {
+      ps_resource_file_insert(server_context, ctx->resource_cache_key,
+                              headers, spill_file, now_ms);
+      spill_file.clear();
+    } else if (hot_cache != NULL && ctx->resource_capture != NULL &&
+               !ctx->base_fetch->capture_overflowed() &&
+               hot_cache->Insert(ctx->resource_cache_key, headers,
+                                 *ctx->resource_capture, now_ms,
+                                 headers.CacheExpirationTimeMs())) {
+      server_context->resource_hot_cache_inserts()->Add(1);
+    }
+  }
+  if (!spill_file.empty()) {
+    server_context->file_system()->RemoveFile(
+        spill_file.c_str(), server_context->message_handler());
+  }
+
+  delete ctx->resource_capture;
+  ctx->resource_capture = NULL;
+}
+
+// Whether a conditional request is satisfied by a response with these
+// validators.  As in RFC 7232, If-None-Match wins over If-Modified-Since.
+bool ps_request_validators_match(const RequestHeaders& request_headers,
+                                 const ResponseHeaders& response_headers) {
+  const char* if_none_match =
+      request_headers.Lookup1(HttpAttributes::kIfNoneMatch);
+  if (if_none_match != NULL) {
+    const char* etag = response_headers.Lookup1(HttpAttributes::kEtag);
+    if (etag == NULL) {
+      return false;
+    }
+    // Weak comparison: W/"x" matches "x".
+    StringPiece etag_value(etag);
+    if (strings::StartsWith(etag_value, "W/")) {
+      etag_value.remove_prefix(2);
+    }
+    StringPieceVector candidates;
+    SplitStringPieceToVector(if_none_match, ",", &candidates,
+                             true /* omit_empty_strings */);
+    for (int i = 0, n = candidates.size(); i < n; ++i) {
+      StringPiece candidate = candidates[i];
+      TrimWhitespace(&candidate);
+      if (candidate == "*") {
+        return true;
+      }
+      if (strings::StartsWith(candidate, "W/")) {
+        candidate.remove_prefix(2);
+      }
+      if (candidate == etag_value) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  const char* if_modified_since =
+      request_headers.Lookup1(HttpAttributes::kIfModifiedSince);
+  const char* last_modified =
+      response_headers.Lookup1(HttpAttributes::kLastModified);
+  int64 if_modified_since_ms, last_modified_ms;
+  return (if_modified_since != NULL && last_modified != NULL &&
+          ConvertStringToTime(if_modified_since, &if_modified_since_ms) &&
+          ConvertStringToTime(last_modified, &last_modified_ms) &&
+          last_modified_ms <= if_modified_since_ms);
+}
+
+// Answers a conditional request for a .pagespeed. resource with a 304 if we
+// recently served that url, which proves its hash was valid, and the request's
+// validators match what we served.  Returns NGX_DECLINED if the request has
+// to go through ResourceFetch, otherwise the result of sending the 304.
+ngx_int_t ps_resource_not_modified(ngx_http_request_t* r,
+                                   NgxServerContext* server_context,
+                                   const RewriteOptions* options,
+                                   StringPiece url,
+                                   const RequestHeaders& request_headers) {
+  NgxResponseCache* cache = server_context->resource_validators();
+  GoogleString key;
+  url.CopyToString(&key);
+  int64 now_ms = server_context->timer()->NowMs();
+  const NgxResponseCache::Entry* entry = cache->Lookup(key, now_ms);
+  if (entry != NULL &&
+      !options->IsUrlCacheValid(url, entry->insert_time_ms,
+                                true /* search_wildcards */)) {
+    cache->Delete(key);
+    entry = NULL;
+  }
+  if (entry == NULL ||
+      !ps_request_validators_match(request_headers, entry->headers)) {
+    return NGX_DECLINED;
+  }
+  server_context->resource_not_modified_responses()->Add(1);
+
+  ResponseHeaders response_headers;
+  response_headers.CopyFrom(entry->headers);
+  response_headers.SetStatusAndReason(HttpStatus::kNotModified);
+  response_headers.FixDateHeaders(now_ms);
+  if (copy_response_headers_to_ngx(r, response_headers, kDontPreserveHeaders)
+      != NGX_OK) {
+    return NGX_ERROR;
+  }
+  ngx_http_clear_content_length(r);
+  r->header_only = 1;
+  return ngx_http_send_header(r);
+}
+
+// Called when PageSpeed is done serving a .pagespeed. resource.  Remembers the
+// headers a 304 for the url has to carry, so that ps_resource_not_modified()
+// can answer revalidations on its own.
+void ps_resource_validators_insert(ngx_http_request_t* r,
+                                   ps_request_ctx_t* ctx) {
+  ps_srv_conf_t* cfg_s = ps_get_srv_config(r);
+  NgxServerContext* server_context = cfg_s->server_context;
+  NgxResponseCache* cache = server_context->resource_validators();
+  if (cache == NULL) {
+    return;
+  }
+
+  const ResponseHeaders* served = ctx->base_fetch->response_headers();
+  ResponseHeaders headers;
+  headers.CopyFrom(*served);
+  int64 now_ms = server_context->timer()->NowMs();
+  if (!ps_resource_is_shareable(&headers, now_ms)) {
+    return;
+  }
+
+  // Keep only what RFC 7232 says a 304 should carry, plus Last-Modified for
+  // matching If-Modified-Since.
+  static const char* const kValidatorHeaders[] = {
+    HttpAttributes::kCacheControl,
+    HttpAttributes::kEtag,
+    HttpAttributes::kExpires,
+    HttpAttributes::kLastModified,
+    HttpAttributes::kVary,
+  };
+  ResponseHeaders validators;
+  validators.set_major_version(1);
+  validators.set_minor_version(1);
+  for (int i = 0, n = arraysize(kValidatorHeaders); i < n; ++i) {
+    ConstStringStarVector values;
+    if (served->Lookup(kValidatorHeaders[i], &values)) {
+      for (int j = 0, m = values.size(); j < m; ++j) {
+        if (values[j] != NULL) {
+          validators.Add(kValidatorHeaders[i], *values[j]);
+        }
+      }
+    }
+  }
+  if (!validators.Has(HttpAttributes::kEtag) &&
+      !validators.Has(HttpAttributes::kLastModified)) {
+    return;
+  }
+  validators.SetDate(now_ms);
+
+  cache->Insert(ctx->url_string, validators, "", now_ms,
+                headers.CacheExpirationTimeMs());
+}
+
+// If this url was an html page the last time we saw it, sends a 103 Early Hints
+// response with the resources NgxPreloadHintsFilter found on it, so the browser
+// can start fetching those while the upstream works on the page.  HTTP/1.0
+// clients don't understand 1xx responses, and nginx can't send them over
+// HTTP/2, so this is HTTP/1.1 only.  Returns NGX_ERROR if the connection
+// failed, NGX_OK otherwise.
+ngx_int_t ps_send_early_hints(ngx_http_request_t* r, ps_srv_conf_t* cfg_s,
+                              StringPiece url) {
+  if (!cfg_s->server_context->config()->early_hints() ||
+      r->http_version != NGX_HTTP_VERSION_11 ||
+      !(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
+    return NGX_OK;
+  }
+
+  GoogleString link_header;
+  if (!cfg_s->server_context->GetPreloadHints(url, &link_header)) {
+    return NGX_OK;
+  }
+
+  GoogleString response =
+      StrCat("HTTP/1.1 103 Early Hints\r\nLink: ", link_header, "\r\n\r\n");
+  ngx_chain_t* out = NULL;
+  if (string_piece_to_buffer_chain(r->pool, response, &out,
+                                   false /* send_last_buf */,
+                                   true /* send_flush */) != NGX_OK) {
+    return NGX_ERROR;
+  }
+  // Go straight to the write filter: this isn't the response, so the header
+  // and body filters mustn't see it.  The write filter keeps whatever the
+  // socket doesn't take right away queued ahead of the real response.
+  if (ngx_http_write_filter(r, out) == NGX_ERROR) {
+    return NGX_ERROR;
+  }
+  return NGX_OK;
+}
+
 // Set us up for processing a request.  Creates a request context and determines
 // which handler should deal with the request.
 RequestRouting::Response ps_route_request(ngx_http_request_t* r) {
@@ -1935,6 +2639,50 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
     return NGX_DECLINED;
   }
 
+  // Revalidations of .pagespeed. resources we know to be current don't need
+  // PageSpeed either.
+  bool resource_validators_eligible =
+      pagespeed_resource &&
+      cfg_s->server_context->resource_validators() != NULL &&
+      custom_options.get() == NULL &&
+      (r->method == NGX_HTTP_GET || r->method == NGX_HTTP_HEAD);
+  if (resource_validators_eligible &&
+      (request_headers->Has(HttpAttributes::kIfNoneMatch) ||
+       request_headers->Has(HttpAttributes::kIfModifiedSince))) {
+    ngx_int_t rc = ps_resource_not_modified(
+        r, cfg_s->server_context, options, url_string, *request_headers);
+    if (rc != NGX_DECLINED) {
+      return rc;
+    }
+  }
+
+  // Hot .pagespeed. resources are served right here, without a trip through a
+  // PageSpeed thread: small ones from memory, large ones from files with
+  // sendfile.  Requests with custom options may rewrite the resource
+  // differently, so they always take the long way.
+  GoogleString resource_cache_key;
+  NgxResponseCache* resource_hot_cache =
+      cfg_s->server_context->resource_hot_cache();
+  NgxResponseCache* resource_files = cfg_s->server_context->resource_files();
+  if (pagespeed_resource &&
+      (resource_hot_cache != NULL || resource_files != NULL) &&
+      custom_options.get() == NULL &&
+      (r->method == NGX_HTTP_GET || r->method == NGX_HTTP_HEAD)) {
+    resource_cache_key = ps_resource_cache_key(url_string, *request_headers);
+    ngx_int_t rc = NGX_DECLINED;
+    if (resource_hot_cache != NULL) {
+      rc = ps_resource_hot_cache_lookup(
+          r, cfg_s->server_context, options, url_string, resource_cache_key);
+    }
+    if (rc == NGX_DECLINED && resource_files != NULL) {
+      rc = ps_resource_file_lookup(
+          r, cfg_s->server_context, options, url_string, resource_cache_key);
+    }
+    if (rc != NGX_DECLINED) {
+      return rc;
+    }
+  }
+
   if (!html_rewrite) {
     // create request ctx
     CHECK(ctx == NULL);
@@ -1990,6 +2738,24 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
     ps_create_base_fetch(url.Spec(), ctx, request_context,
                          request_headers.release(), kPageSpeedResource,
                          options);
+    ctx->record_resource_validators = resource_validators_eligible;
+    if (!resource_cache_key.empty() && r->method == NGX_HTTP_GET) {
+      ctx->resource_cache_key = resource_cache_key;
+      // Only what fits the hot cache is held in memory; anything bound for
+      // the sendfile resource store is written to disk by pagespeed itself.
+      if (resource_hot_cache != NULL) {
+        ctx->resource_capture = new GoogleString;
+        ctx->base_fetch->StartCapture(ctx->resource_capture,
+                                      resource_hot_cache->max_entry_bytes());
+      }
+      if (resource_files != NULL) {
+        ctx->base_fetch->StartSpill(
+            StrCat(cfg_s->server_context->resource_files_dir(), "/spill-"),
+            cfg_s->server_context->config()->sendfile_resource_min_size_kb() *
+                1024,
+            kResourceFileMaxBytes);
+      }
+    }
     ResourceFetch::Start(
         url,
         custom_options.release() /* null if there aren't custom options */,
@@ -2070,8 +2836,23 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
   }
 
   if (html_rewrite && options->IsAllowed(url.Spec())) {
+    // Requests with options of their own, including experiment traffic, never
+    // use the html output cache.
+    NgxResponseCache* html_output_cache =
+        cfg_s->server_context->html_output_cache();
+    if (html_output_cache != NULL && custom_options.get() == NULL &&
+        ps_html_output_cache_lookup(r, ctx, cfg_s, options, url_string,
+                                    *request_headers, *response_headers)) {
+      return NGX_OK;
+    }
+
     ps_create_base_fetch(url.Spec(), ctx, request_context,
                          request_headers.release(), kHtmlTransform, options);
+    if (!ctx->html_output_cache_key.empty()) {
+      ctx->html_output_capture = new GoogleString;
+      ctx->base_fetch->StartCapture(ctx->html_output_capture,
+                                    html_output_cache->max_entry_bytes());
+    }
     // Do not store driver in request_context, it's not safe.
     RewriteDriver* driver;
 
@@ -2092,7 +2873,8 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
     driver->set_pagespeed_query_params(pagespeed_query_params);
     driver->set_pagespeed_option_cookies(pagespeed_option_cookies);
 
-    // TODO(jefftk): FlushEarlyFlow would go here.
+    // FlushEarlyFlow isn't supported.  EarlyHints does a similar job from the
+    // content phase, see ps_send_early_hints().
     ProxyFetchPropertyCallbackCollector* property_callback =
         ProxyFetchFactory::InitiatePropertyCacheLookup(
             !html_rewrite /* is_resource_fetch */,
@@ -2111,9 +2893,29 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
     return NGX_OK;
   }
 
+  // Urls that IPRO recently found it can't rewrite can skip the lookup, and
+  // the trip through pagespeed's threads that comes with it.  The verdict
+  // depends on the options, so requests with options of their own don't use
+  // the index.  Only GETs are judged, so only they use it.
+  NgxSharedUrlTable* ipro_negative_index =
+      cfg_s->server_context->ngx_rewrite_driver_factory()->
+      ipro_negative_index();
+  bool ipro_known_unrewritable = false;
+  if (ipro_negative_index != NULL && custom_options.get() == NULL &&
+      r->method == NGX_HTTP_GET && options->in_place_rewriting_enabled()) {
+    ctx->ipro_index_key = NgxSharedUrlTable::Hash(
+        StrCat(options->signature(), "\n", url_string));
+    if (ipro_negative_index->Lookup(ctx->ipro_index_key,
+                                    cfg_s->server_context->timer()->NowMs())) {
+      cfg_s->server_context->ipro_negative_index_hits()->Add(1);
+      ipro_known_unrewritable = true;
+    }
+  }
+
   if (options->in_place_rewriting_enabled() &&
       options->enabled() &&
-      options->IsAllowed(url.Spec())) {
+      options->IsAllowed(url.Spec()) &&
+      !ipro_known_unrewritable) {
     ps_create_base_fetch(url.Spec(), ctx, request_context,
                          request_headers.release(), kIproLookup, options);
 
@@ -2149,11 +2951,28 @@ ngx_int_t ps_resource_handler(ngx_http_request_t* r,
                 "Passing on content handling for non-pagespeed resource '%s'",
                 url_string.c_str());
   CHECK(ctx->base_fetch == NULL);
+  if (!html_rewrite &&
+      ps_send_early_hints(r, cfg_s, url_string) == NGX_ERROR) {
+    return NGX_ERROR;
+  }
   // set html_rewrite flag.
   ctx->html_rewrite = true;
   return NGX_DECLINED;
 }
 
+// Hands html to the proxy_fetch, keeping a copy for as long as the html
+// rewrite deadline may still make us send the original.  Once the deadline
+// has passed the html only goes to that copy.
+void ps_write_html(ps_request_ctx_t* ctx, StringPiece html,
+                   MessageHandler* handler) {
+  if (ctx->html_original != NULL) {
+    html.AppendToString(ctx->html_original);
+  }
+  if (!ctx->html_rewrite_timed_out) {
+    ctx->proxy_fetch->Write(html, handler);
+  }
+}
+
 // Send each buffer in the chain to the proxy_fetch for optimization.
 // Eventually it will make it's way, optimized, to base_fetch.
 void ps_send_to_pagespeed(ngx_http_request_t* r,
@@ -2168,27 +2987,33 @@ void ps_send_to_pagespeed(ngx_http_request_t* r,
     // pagespeed.
     cur->buf->last_buf = 0;
 
-    CHECK(ctx->proxy_fetch != NULL);
+    CHECK(ctx->proxy_fetch != NULL || ctx->html_rewrite_timed_out);
     if (ctx->inflater_ == NULL) {
-      ctx->proxy_fetch->Write(
-          StringPiece(reinterpret_cast<char*>(cur->buf->pos),
-                      cur->buf->last - cur->buf->pos), cfg_s->handler);
+      ps_write_html(ctx,
+                    StringPiece(reinterpret_cast<char*>(cur->buf->pos),
+                                cur->buf->last - cur->buf->pos),
+                    cfg_s->handler);
     } else {
-      char buf[kStackBufferSize];
+      // ProxyFetch copies what we write, so a single scratch buffer per worker
+      // is enough.  Make it large so a typical compressed buffer inflates in
+      // one or two calls.
+      static char inflate_buffer[kInflateBufferSize];
       ctx->inflater_->SetInput(reinterpret_cast<char*>(cur->buf->pos),
                                cur->buf->last - cur->buf->pos);
       while (ctx->inflater_->HasUnconsumedInput()) {
         int num_inflated_bytes = ctx->inflater_->InflateBytes(
-            buf, kStackBufferSize);
+            inflate_buffer, kInflateBufferSize);
         if (num_inflated_bytes < 0) {
           cfg_s->handler->Message(kWarning, "Corrupted inflation");
+          break;
         } else if (num_inflated_bytes > 0) {
-          ctx->proxy_fetch->Write(StringPiece(buf, num_inflated_bytes),
-                                  cfg_s->handler);
+          ps_write_html(ctx, StringPiece(inflate_buffer, num_inflated_bytes),
+                        cfg_s->handler);
         }
       }
     }
-    if (cur->buf->flush && ctx->follow_flushes) {
+    if (cur->buf->flush && ctx->follow_flushes &&
+        ctx->proxy_fetch != NULL) {
       // Calling ctx->proxy_fetch->Flush(cfg_s->handler) will be a no-op here,
       // unless we have follow_flushes or flush_html enabled. Note that PSOL
       // might aggregate multiple flushes into 1, and actually flush a little bit
@@ -2206,7 +3031,7 @@ void ps_send_to_pagespeed(ngx_http_request_t* r,
     cur->buf->pos = cur->buf->last;
   }
 
-  if (last_buf) {
+  if (last_buf && ctx->proxy_fetch != NULL) {
     ctx->proxy_fetch->Done(true /* success */);
     ctx->proxy_fetch = NULL;  // ProxyFetch deletes itself on Done().
   }
@@ -2337,6 +3162,73 @@ namespace html_rewrite {
 ngx_http_output_header_filter_pt ngx_http_next_header_filter;
 ngx_http_output_body_filter_pt ngx_http_next_body_filter;
 
+// Passes on the original html collected so far.
+ngx_int_t ps_html_rewrite_send_original(ngx_http_request_t* r,
+                                        ps_request_ctx_t* ctx,
+                                        bool last_buf) {
+  ngx_chain_t* out = NULL;
+  if (!ctx->html_original->empty() || last_buf) {
+    if (string_piece_to_buffer_chain(r->pool, *ctx->html_original, &out,
+                                     last_buf, false /* send_flush */)
+        != NGX_OK) {
+      return NGX_ERROR;
+    }
+    ctx->html_original->clear();
+  }
+  return ngx_http_next_body_filter(r, out);
+}
+
+// Runs when HtmlRewriteDeadlineMs passes before pagespeed sent any rewritten
+// html.  We stop waiting on pagespeed, and send the original html we have so
+// far.  The rest goes out as it arrives, see ps_html_rewrite_body_filter().
+//
+// Splicing the original into rewritten html that was already sent isn't
+// possible, because we can't tell which part of the original that rewritten
+// html corresponds to, so the deadline stops applying as soon as pagespeed
+// starts sending html.
+void ps_html_rewrite_deadline_handler(ngx_event_t* ev) {
+  ngx_http_request_t* r = static_cast<ngx_http_request_t*>(ev->data);
+  ngx_connection_t* c = r->connection;
+  ps_request_ctx_t* ctx = ps_get_request_context(r);
+  ps_srv_conf_t* cfg_s = ps_get_srv_config(r);
+
+  ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                 "http pagespeed html rewrite deadline \"%V\"", &r->uri);
+
+  // Sending pagespeed's headers cancels the deadline, but if headers went out
+  // some other way the original can't follow them either.
+  if (r->header_sent) {
+    return;
+  }
+
+  cfg_s->server_context->html_rewrite_deadline_hits()->Add(1);
+  ctx->html_rewrite_timed_out = true;
+
+  // If the upstream is done, it already tried to finalize the request and
+  // left that to us since pagespeed had it buffered.
+  bool upstream_done = (ctx->proxy_fetch == NULL);
+  if (!upstream_done) {
+    ctx->proxy_fetch->Done(false /* success */);
+    ctx->proxy_fetch = NULL;  // ProxyFetch deletes itself on Done().
+  }
+  ps_release_base_fetch(ctx);
+  ps_set_buffered(r, false);
+
+  // The headers we stripped in ps_html_rewrite_header_filter are still in
+  // place.
+  ngx_int_t rc = ngx_http_next_header_filter(r);
+  if (rc == NGX_ERROR || rc > NGX_OK) {
+    rc = NGX_ERROR;
+  } else {
+    rc = ps_html_rewrite_send_original(r, ctx, upstream_done);
+  }
+
+  if (upstream_done || rc == NGX_ERROR) {
+    ngx_http_finalize_request(r, rc);
+  }
+  ngx_http_run_posted_requests(c);
+}
+
 // After pagespeed has had a chance to run, copy the headers it produced to
 // nginx so it can send them out to the browser.
 ngx_int_t ps_html_rewrite_header_filter(ngx_http_request_t* r) {
@@ -2377,6 +3269,18 @@ ngx_int_t ps_html_rewrite_header_filter(ngx_http_request_t* r) {
     return ngx_http_next_header_filter(r);
   }
 
+  // Decide on oversized html before any pagespeed state is set up for it, so
+  // that nginx sends it through its normal output path: no copies into
+  // memory, no trip through the rewrite thread, and sendfile still applies.
+  int64 max_content_length =
+      cfg_s->server_context->config()->html_rewrite_max_content_length();
+  if (max_content_length >= 0 &&
+      r->headers_out.content_length_n > max_content_length) {
+    cfg_s->server_context->html_rewrite_content_length_bypasses()->Add(1);
+    ctx->html_rewrite = false;
+    return ngx_http_next_header_filter(r);
+  }
+
   ngx_int_t rc = ps_resource_handler(r, true /* html rewrite */,
                                      RequestRouting::kResource);
   if (rc != NGX_OK) {
@@ -2384,6 +3288,12 @@ ngx_int_t ps_html_rewrite_header_filter(ngx_http_request_t* r) {
     return ngx_http_next_header_filter(r);
   }
 
+  if (ctx->html_output_cache_hit) {
+    // ps_html_output_cache_lookup() already put the cached headers in place.
+    // We replace the body with the cached one in the body filter.
+    return ngx_http_next_header_filter(r);
+  }
+
   if (r->headers_out.content_encoding &&
       r->headers_out.content_encoding->value.len) {
     // headers_out.content_encoding will be set to the exact last
@@ -2393,20 +3303,12 @@ ngx_int_t ps_html_rewrite_header_filter(ngx_http_request_t* r) {
     if (!ps_has_stacked_content_encoding(r)) {
       StringPiece content_encoding =
           str_to_string_piece(r->headers_out.content_encoding->value);
-      GzipInflater::InflateType inflate_type = GzipInflater::kGzip;
-      bool is_encoded = false;
-      if (StringCaseEqual(content_encoding, "deflate")) {
-        is_encoded = true;
-        inflate_type = GzipInflater::kDeflate;
-      } else if (StringCaseEqual(content_encoding, "gzip")) {
-        is_encoded = true;
-      }
-
-      if (is_encoded) {
+      // NgxInflater knows about gzip and deflate, and about br when we were
+      // built against the brotli decoder.
+      ctx->inflater_ = NgxInflater::Acquire(content_encoding);
+      if (ctx->inflater_ != NULL) {
         r->headers_out.content_encoding->hash = 0;
         r->headers_out.content_encoding = NULL;
-        ctx->inflater_ = new GzipInflater(inflate_type);
-        ctx->inflater_->Init();
       }
     }
   }
@@ -2418,6 +3320,23 @@ ngx_int_t ps_html_rewrite_header_filter(ngx_http_request_t* r) {
   // TODO(jefftk): is this thread safe?
   copy_response_headers_from_ngx(r, ctx->base_fetch->response_headers());
 
+  GoogleString link_header;
+  if (cfg_s->server_context->config()->preload_link_headers() &&
+      cfg_s->server_context->GetPreloadHints(ctx->url_string, &link_header)) {
+    ctx->base_fetch->response_headers()->Add("Link", link_header);
+  }
+
+  int64 deadline_ms =
+      cfg_s->server_context->config()->html_rewrite_deadline_ms();
+  if (deadline_ms >= 0) {
+    ctx->html_original = new GoogleString;
+    ngx_event_t* ev = &ctx->html_rewrite_deadline;
+    ev->handler = ps_html_rewrite_deadline_handler;
+    ev->data = r;
+    ev->log = r->connection->log;
+    ngx_add_timer(ev, deadline_ms);
+  }
+
   ps_set_buffered(r, true);
   r->filter_need_in_memory = 1;
   return NGX_AGAIN;
@@ -2450,6 +3369,36 @@ ngx_int_t ps_html_rewrite_body_filter(ngx_http_request_t* r, ngx_chain_t* in) {
   ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                  "http pagespeed html rewrite body filter \"%V\"", &r->uri);
 
+  if (ctx->html_output_cache_hit) {
+    // Swallow the upstream body, and send the cached rewritten html once it's
+    // complete.
+    bool last_buf = false;
+    for (ngx_chain_t* cl = in; cl != NULL; cl = cl->next) {
+      last_buf = last_buf || cl->buf->last_buf;
+      cl->buf->pos = cl->buf->last;
+      cl->buf->file_pos = cl->buf->file_last;
+    }
+    if (!last_buf || ctx->html_output_cache_out == NULL) {
+      return NGX_OK;
+    }
+    ngx_chain_t* out = ctx->html_output_cache_out;
+    ctx->html_output_cache_out = NULL;
+    return ngx_http_next_body_filter(r, out);
+  }
+
+  if (ctx->html_rewrite_timed_out) {
+    // Pagespeed is out of the picture, send the html as it arrives.
+    bool last_buf = false;
+    for (ngx_chain_t* cl = in; cl != NULL; cl = cl->next) {
+      last_buf = last_buf || cl->buf->last_buf;
+    }
+    if (in != NULL) {
+      // With the deadline passed this only inflates the html if necessary and
+      // collects it in html_original.
+      ps_send_to_pagespeed(r, ctx, cfg_s, in);
+    }
+    return ps_html_rewrite_send_original(r, ctx, last_buf);
+  }
 
   if (in != NULL) {
     // Send all input data to the proxy fetch.
@@ -2556,6 +3505,29 @@ ngx_int_t ps_in_place_check_header_filter(ngx_http_request_t* r) {
     const SystemRewriteOptions* options = SystemRewriteOptions::DynamicCast(
         ctx->driver->options());
 
+    // Only one worker at a time records a given url; the others let the
+    // response pass.  If the table has no room for our claim we record
+    // anyway, as we would without the table.
+    NgxSharedUrlTable* ipro_recordings =
+        server_context->ngx_rewrite_driver_factory()->ipro_recordings();
+    if (ipro_recordings != NULL) {
+      uint64 key = NgxSharedUrlTable::Hash(
+          StrCat(ctx->driver->CacheFragment(), "\n", cache_url));
+      int64 now_ms = server_context->timer()->NowMs();
+      int64 expiration_ms = now_ms + kIproRecordingClaimMs;
+      switch (ipro_recordings->InsertIfAbsent(key, expiration_ms, now_ms)) {
+        case NgxSharedUrlTable::kPresent:
+          server_context->ipro_recordings_suppressed()->Add(1);
+          return ps_decline_request(r);
+        case NgxSharedUrlTable::kInserted:
+          ctx->ipro_recording_key = key;
+          ctx->ipro_recording_expiration_ms = expiration_ms;
+          break;
+        case NgxSharedUrlTable::kNoRoom:
+          break;
+      }
+    }
+
     RequestContextPtr request_context(
         cfg_s->server_context->NewRequestContext(r));
     request_context->set_options(options->ComputeHttpOptions());
@@ -2575,8 +3547,9 @@ ngx_int_t ps_in_place_check_header_filter(ngx_http_request_t* r) {
         server_context->http_cache(),
         server_context->statistics(),
         message_handler);
-    // set in memory flag for in_place_body_filter
-    r->filter_need_in_memory = 1;
+    // We don't set r->filter_need_in_memory: ps_in_place_body_filter reads
+    // file-backed buffers itself, so static files keep going out with
+    // sendfile.
 
     // We don't have the response headers at all yet because we haven't yet gone
     // to the backend.
@@ -2584,11 +3557,48 @@ ngx_int_t ps_in_place_check_header_filter(ngx_http_request_t* r) {
     server_context->rewrite_stats()->ipro_not_rewritable()->Add(1);
     message_handler->Message(
         kInfo, "Could not rewrite resource in-place: %s", url.c_str());
+    // A HEAD that missed the cache tells us nothing about the url; only a
+    // verdict from the cache does.
+    if (ctx->ipro_index_key != 0 && !r->header_only &&
+        status_code != CacheUrlAsyncFetcher::kNotInCacheStatus) {
+      NgxRewriteDriverFactory* factory =
+          server_context->ngx_rewrite_driver_factory();
+      int64 now_ms = server_context->timer()->NowMs();
+      factory->ipro_negative_index()->Insert(
+          ctx->ipro_index_key, now_ms + factory->ipro_negative_index_ttl_ms(),
+          now_ms);
+      server_context->ipro_negative_index_inserts()->Add(1);
+    }
   }
 
   return ps_decline_request(r);
 }
 
+// Records the file region buf refers to, reading it into a scratch buffer.  The
+// buffer itself is left alone, so it can still be sent with sendfile.  Returns
+// false if the file can't be read.
+bool ps_in_place_record_file_buf(ngx_http_request_t* r,
+                                 InPlaceResourceRecorder* recorder,
+                                 ngx_buf_t* buf) {
+  static u_char read_buffer[kInPlaceReadBufferSize];
+  off_t offset = buf->file_pos;
+  while (offset < buf->file_last && !recorder->failed()) {
+    size_t size = std::min(static_cast<size_t>(buf->file_last - offset),
+                           kInPlaceReadBufferSize);
+    ssize_t n = ngx_read_file(buf->file, read_buffer, size, offset);
+    if (n <= 0) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "ps in place body filter: could not read \"%V\"",
+                    &buf->file->name);
+      return false;
+    }
+    recorder->Write(StringPiece(reinterpret_cast<char*>(read_buffer), n),
+                    recorder->handler());
+    offset += n;
+  }
+  return true;
+}
+
 // If we've decided that we should record this response for future optimization
 // with IPRO, then log the bytes as they come through
 ngx_int_t ps_in_place_body_filter(ngx_http_request_t* r, ngx_chain_t* in) {
@@ -2603,10 +3613,17 @@ ngx_int_t ps_in_place_body_filter(ngx_http_request_t* r, ngx_chain_t* in) {
   InPlaceResourceRecorder* recorder = ctx->recorder;
   for (ngx_chain_t* cl = in; cl; cl = cl->next) {
     if (ngx_buf_size(cl->buf)) {
-      CHECK(ngx_buf_in_memory(cl->buf));
-      StringPiece contents(reinterpret_cast<char*>(cl->buf->pos),
-                           ngx_buf_size(cl->buf));
-      recorder->Write(contents, recorder->handler());
+      if (ngx_buf_in_memory(cl->buf)) {
+        StringPiece contents(reinterpret_cast<char*>(cl->buf->pos),
+                             ngx_buf_size(cl->buf));
+        recorder->Write(contents, recorder->handler());
+      } else if (!ps_in_place_record_file_buf(r, recorder, cl->buf)) {
+        // Give up on recording, but let nginx deal with the response.
+        recorder->DoneAndSetHeaders(NULL, false /* incomplete response */);
+        ctx->recorder = NULL;
+        ps_release_ipro_recording(ctx);
+        break;
+      }
     }
 
     if (cl->buf->flush) {
@@ -2620,6 +3637,7 @@ ngx_int_t ps_in_place_body_filter(ngx_http_request_t* r, ngx_chain_t* in) {
           &response_headers,
           cl->buf->last_buf /* response is complete if last_buf is set */);
       ctx->recorder = NULL;
+      ps_release_ipro_recording(ctx);
       break;
     }
   }
@@ -3256,6 +4274,7 @@ void ps_exit_child_process(ngx_cycle_t* cycle) {
   ps_main_conf_t* cfg_m = static_cast<ps_main_conf_t*>(
       ngx_http_cycle_get_module_main_conf(cycle, ngx_pagespeed));
   NgxBaseFetch::Terminate();
+  NgxInflater::ShutDown();
   if (cfg_m != NULL && cfg_m->driver_factory != NULL) {
     cfg_m->driver_factory->ShutDown();
   }
@@ -3298,6 +4317,7 @@ ngx_int_t ps_init_child_process(ngx_cycle_t* cycle) {
           cscfp[s]->ctx->loc_conf[ngx_http_core_module.ctx_index]);
       cfg_m->driver_factory->SetServerContextMessageHandler(
           cfg_s->server_context, clcf->error_log);
+      cfg_s->server_context->InitWorker();
     }
   }
 
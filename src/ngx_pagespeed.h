@@ -42,8 +42,8 @@ extern "C" {
 
 namespace net_instaweb {
 
-class GzipInflater;
 class NgxBaseFetch;
+class NgxInflater;
 class ProxyFetch;
 class RewriteDriver;
 class RequestHeaders;
@@ -96,7 +96,7 @@ typedef struct {
 
   // for html rewrite
   ProxyFetch* proxy_fetch;
-  GzipInflater* inflater_;
+  NgxInflater* inflater_;
 
   // for in place resource
   RewriteDriver* driver;
@@ -113,6 +113,40 @@ typedef struct {
   bool location_field_set;
   bool psol_vary_accept_only;
   bool follow_flushes;
+
+  // for the html output cache
+  // On a miss, the key the rewritten html will be stored under and the body
+  // captured from base_fetch so far.
+  GoogleString html_output_cache_key;
+  GoogleString* html_output_capture;
+  // On a hit, the cached body we send in place of the upstream response.
+  bool html_output_cache_hit;
+  ngx_chain_t* html_output_cache_out;
+
+  // for the resource hot cache and the sendfile resource store
+  // On a miss, the key the .pagespeed. resource will be stored under and, if
+  // there is a resource hot cache, the body captured from base_fetch so far.
+  GoogleString resource_cache_key;
+  GoogleString* resource_capture;
+  // Whether to remember the validators of the .pagespeed. resource we serve,
+  // for answering later revalidations with a 304.
+  bool record_resource_validators;
+
+  // for the html rewrite deadline
+  // Fires when pagespeed is taking too long to start on the html.  Until it
+  // does, html_original holds the (inflated) html we handed to pagespeed so
+  // far, so that we can send that instead.
+  ngx_event_t html_rewrite_deadline;
+  GoogleString* html_original;
+  bool html_rewrite_timed_out;
+
+  // Where an IPRO "not rewritable" verdict for this request goes in the
+  // shared negative index, or 0 if it doesn't use the index.
+  uint64 ipro_index_key;
+  // While we're recording this response for IPRO, our entry in the shared
+  // table of recordings in progress, or 0, and when it expires.
+  uint64 ipro_recording_key;
+  int64 ipro_recording_expiration_ms;
 } ps_request_ctx_t;
 
 ps_request_ctx_t* ps_get_request_context(ngx_http_request_t* r);
@@ -0,0 +1,109 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+
+
+#include "ngx_preload_hints_filter.h"
+
+#include "ngx_server_context.h"
+
+#include "net/instaweb/rewriter/public/rewrite_driver.h"
+#include "pagespeed/kernel/html/html_element.h"
+#include "pagespeed/kernel/html/html_name.h"
+#include "pagespeed/kernel/http/google_url.h"
+
+namespace net_instaweb {
+
+NgxPreloadHintsFilter::NgxPreloadHintsFilter(RewriteDriver* driver)
+    : driver_(driver) {
+}
+
+NgxPreloadHintsFilter::~NgxPreloadHintsFilter() { }
+
+void NgxPreloadHintsFilter::StartDocument() {
+  link_header_.clear();
+  seen_urls_.clear();
+}
+
+void NgxPreloadHintsFilter::StartElement(HtmlElement* element) {
+  if (element->keyword() == HtmlName::kLink) {
+    const char* rel = element->AttributeValue(HtmlName::kRel);
+    const char* href = element->AttributeValue(HtmlName::kHref);
+    if (rel == NULL || href == NULL) {
+      return;
+    }
+    if (StringCaseEqual(rel, "stylesheet")) {
+      AddHint(href, "style");
+    } else if (StringCaseEqual(rel, "preload")) {
+      // Pages that preload their fonts already know what they need; pass
+      // those on too, since fonts otherwise aren't discovered until the css
+      // that uses them has been parsed.
+      const HtmlElement::AttributeList& attrs = element->attributes();
+      for (HtmlElement::AttributeConstIterator i(attrs.begin());
+           i != attrs.end(); ++i) {
+        const HtmlElement::Attribute& attr = *i;
+        if (StringCaseEqual(attr.name_str(), "as") &&
+            attr.DecodedValueOrNull() != NULL &&
+            StringCaseEqual(attr.DecodedValueOrNull(), "font")) {
+          AddHint(href, "font");
+        }
+      }
+    }
+  } else if (element->keyword() == HtmlName::kScript) {
+    // Async and deferred scripts don't hold up rendering.
+    const char* src = element->AttributeValue(HtmlName::kSrc);
+    if (src != NULL &&
+        element->FindAttribute(HtmlName::kAsync) == NULL &&
+        element->FindAttribute(HtmlName::kDefer) == NULL) {
+      AddHint(src, "script");
+    }
+  }
+}
+
+void NgxPreloadHintsFilter::EndDocument() {
+  // Always store what we found, so a page that stopped referencing its
+  // resources stops getting hints for them.
+  NgxServerContext* server_context =
+      static_cast<NgxServerContext*>(driver_->server_context());
+  server_context->SetPreloadHints(driver_->url(), link_header_);
+}
+
+void NgxPreloadHintsFilter::AddHint(StringPiece url, StringPiece as) {
+  if (static_cast<int>(seen_urls_.size()) >= kMaxHints) {
+    return;
+  }
+  GoogleUrl resolved(driver_->base_url(), url);
+  if (!resolved.IsWebValid()) {
+    return;
+  }
+  GoogleString spec = resolved.Spec().as_string();
+  if (!seen_urls_.insert(spec).second) {
+    return;
+  }
+  StrAppend(&link_header_, link_header_.empty() ? "" : ", ",
+            "<", spec, ">; rel=preload; as=", as);
+  if (as == "font") {
+    // Fonts are always fetched in cors mode, and a preload that isn't won't
+    // be used.
+    link_header_.append("; crossorigin");
+  }
+}
+
+}  // namespace net_instaweb
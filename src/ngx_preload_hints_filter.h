@@ -0,0 +1,68 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+
+//
+// NgxPreloadHintsFilter records the stylesheets, blocking scripts and fonts a
+// page references, in the order they appear and after any other filter has
+// rewritten their urls.  It hands them to NgxServerContext::SetPreloadHints()
+// as a Link header value, which ngx_pagespeed sends with later responses for
+// the same page, as a 103 Early Hints response or as a header on the final
+// response.
+
+#ifndef NGX_PRELOAD_HINTS_FILTER_H_
+#define NGX_PRELOAD_HINTS_FILTER_H_
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/html/empty_html_filter.h"
+
+namespace net_instaweb {
+
+class HtmlElement;
+class RewriteDriver;
+
+class NgxPreloadHintsFilter : public EmptyHtmlFilter {
+ public:
+  explicit NgxPreloadHintsFilter(RewriteDriver* driver);
+  virtual ~NgxPreloadHintsFilter();
+
+  virtual void StartDocument();
+  virtual void StartElement(HtmlElement* element);
+  virtual void EndDocument();
+  virtual const char* Name() const { return "NgxPreloadHints"; }
+
+  // We never send more hints than this for a page.
+  static const int kMaxHints = 16;
+
+ private:
+  void AddHint(StringPiece url, StringPiece as);
+
+  RewriteDriver* driver_;
+  GoogleString link_header_;
+  StringSet seen_urls_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxPreloadHintsFilter);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_PRELOAD_HINTS_FILTER_H_
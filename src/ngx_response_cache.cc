@@ -0,0 +1,117 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+
+
+#include "ngx_response_cache.h"
+
+#include "base/logging.h"
+
+namespace net_instaweb {
+
+NgxResponseCache::NgxResponseCache(size_t max_bytes)
+    : max_bytes_(max_bytes),
+      current_bytes_(0) {
+}
+
+NgxResponseCache::~NgxResponseCache() {
+  Clear();
+}
+
+size_t NgxResponseCache::EntrySize(const GoogleString& key,
+                                   const Entry& entry) {
+  size_t size = sizeof(Entry) + key.size() + entry.body.size();
+  for (int i = 0, n = entry.headers.NumAttributes(); i < n; ++i) {
+    size += entry.headers.Name(i).size() + entry.headers.Value(i).size();
+  }
+  return size;
+}
+
+const NgxResponseCache::Entry* NgxResponseCache::Lookup(
+    const GoogleString& key, int64 now_ms) {
+  EntryMap::iterator map_iter = map_.find(key);
+  if (map_iter == map_.end()) {
+    return NULL;
+  }
+  EntryList::iterator list_iter = map_iter->second;
+  if (list_iter->second->expiration_time_ms <= now_ms) {
+    Erase(map_iter);
+    return NULL;
+  }
+  lru_.splice(lru_.begin(), lru_, list_iter);
+  return list_iter->second;
+}
+
+bool NgxResponseCache::Insert(const GoogleString& key,
+                              const ResponseHeaders& headers,
+                              StringPiece body, int64 now_ms,
+                              int64 expiration_time_ms) {
+  Delete(key);
+
+  Entry* entry = new Entry;
+  entry->headers.CopyFrom(headers);
+  body.CopyToString(&entry->body);
+  entry->insert_time_ms = now_ms;
+  entry->expiration_time_ms = expiration_time_ms;
+
+  size_t size = EntrySize(key, *entry);
+  if (size > max_entry_bytes()) {
+    delete entry;
+    return false;
+  }
+
+  while (!lru_.empty() && current_bytes_ + size > max_bytes_) {
+    Erase(map_.find(lru_.back().first));
+  }
+
+  lru_.push_front(KeyEntryPair(key, entry));
+  map_[key] = lru_.begin();
+  current_bytes_ += size;
+  return true;
+}
+
+void NgxResponseCache::Delete(const GoogleString& key) {
+  EntryMap::iterator map_iter = map_.find(key);
+  if (map_iter != map_.end()) {
+    Erase(map_iter);
+  }
+}
+
+void NgxResponseCache::Clear() {
+  for (EntryList::iterator i = lru_.begin(); i != lru_.end(); ++i) {
+    delete i->second;
+  }
+  lru_.clear();
+  map_.clear();
+  current_bytes_ = 0;
+}
+
+void NgxResponseCache::Erase(EntryMap::iterator map_iter) {
+  DCHECK(map_iter != map_.end());
+  EntryList::iterator list_iter = map_iter->second;
+  size_t size = EntrySize(list_iter->first, *list_iter->second);
+  DCHECK_GE(current_bytes_, size);
+  current_bytes_ -= size;
+  delete list_iter->second;
+  lru_.erase(list_iter);
+  map_.erase(map_iter);
+}
+
+}  // namespace net_instaweb
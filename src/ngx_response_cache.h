@@ -0,0 +1,96 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+
+//
+// NgxResponseCache is a small, bounded, in-memory LRU of complete responses
+// (headers plus body) kept by each nginx worker.  It lets us answer repeat
+// requests straight from the nginx thread, without handing them to PSOL.
+// It does no locking of its own, so callers that share one with pagespeed's
+// threads must hold a lock around every call.
+
+#ifndef NGX_RESPONSE_CACHE_H_
+#define NGX_RESPONSE_CACHE_H_
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <utility>
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/http/response_headers.h"
+
+namespace net_instaweb {
+
+class NgxResponseCache {
+ public:
+  struct Entry {
+    ResponseHeaders headers;
+    GoogleString body;
+    int64 insert_time_ms;
+    int64 expiration_time_ms;
+  };
+
+  // max_bytes bounds the approximate memory held by all entries together.
+  explicit NgxResponseCache(size_t max_bytes);
+  ~NgxResponseCache();
+
+  // Returns the entry for key, or NULL if there is none or it expired before
+  // now_ms.  The entry is marked as most recently used, and stays valid until
+  // the next call to Insert(), Delete() or Clear().
+  const Entry* Lookup(const GoogleString& key, int64 now_ms);
+
+  // Stores a copy of headers and body under key, replacing any previous
+  // entry, and evicts least recently used entries to make room.  Returns false
+  // if the entry is too large to be stored.
+  bool Insert(const GoogleString& key, const ResponseHeaders& headers,
+              StringPiece body, int64 now_ms, int64 expiration_time_ms);
+
+  void Delete(const GoogleString& key);
+  void Clear();
+
+  // Entries bigger than this are never stored.
+  size_t max_entry_bytes() const { return max_bytes_ / 8; }
+
+  size_t num_entries() const { return map_.size(); }
+  size_t size_bytes() const { return current_bytes_; }
+
+ private:
+  typedef std::pair<GoogleString, Entry*> KeyEntryPair;
+  typedef std::list<KeyEntryPair> EntryList;
+  typedef std::map<GoogleString, EntryList::iterator> EntryMap;
+
+  static size_t EntrySize(const GoogleString& key, const Entry& entry);
+  void Erase(EntryMap::iterator map_iter);
+
+  const size_t max_bytes_;
+  size_t current_bytes_;
+  // Most recently used entries are at the front.
+  EntryList lru_;
+  EntryMap map_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxResponseCache);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_RESPONSE_CACHE_H_
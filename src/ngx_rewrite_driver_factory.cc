@@ -24,9 +24,12 @@
 #include <cstdio>
 
 #include "log_message_handler.h"
+#include "ngx_fetch.h"
 #include "ngx_message_handler.h"
+#include "ngx_preload_hints_filter.h"
 #include "ngx_rewrite_options.h"
 #include "ngx_server_context.h"
+#include "ngx_shared_url_table.h"
 #include "ngx_url_async_fetcher.h"
 
 #include "net/instaweb/http/public/rate_controller.h"
@@ -82,6 +85,14 @@ NgxRewriteDriverFactory::NgxRewriteDriverFactory(
       use_native_fetcher_(false),
       // 100 Aligns to nginx's server-side default.
       native_fetcher_max_keepalive_requests_(100),
+      native_fetcher_max_idle_connections_(512),
+      native_fetcher_max_idle_connections_per_origin_(32),
+      native_fetcher_max_fetches_per_origin_(16),
+      native_fetcher_slow_origins_interval_sec_(300),
+      ipro_negative_index_slots_(0),
+      ipro_negative_index_ttl_sec_(300),
+      ipro_recording_slots_(0),
+      owns_shared_tables_(false),
       ngx_shared_circular_buffer_(NULL),
       hostname_(hostname.as_string()),
       port_(port),
@@ -119,7 +130,22 @@ UrlAsyncFetcher* NgxRewriteDriverFactory::AllocateFetcher(
         resolver_,
         native_fetcher_max_keepalive_requests_,
         thread_system(),
+        statistics(),
         message_handler());
+    fetcher->SetHttpsOptions(config->https_options());
+    fetcher->SetSslCertificatesDir(config->ssl_cert_directory());
+    fetcher->SetSslCertificatesFile(config->ssl_cert_file());
+    fetcher->set_max_fetches_per_origin(
+        native_fetcher_max_fetches_per_origin_);
+    fetcher->set_slow_origins_interval_ms(
+        native_fetcher_slow_origins_interval_sec_ * Timer::kSecondMs);
+    fetcher->set_upstreams(native_fetcher_upstreams_);
+    if (!fetcher->SetLoopbackSocket(native_fetcher_loopback_socket_)) {
+      message_handler()->Message(
+          kError, "NativeFetcherLoopbackSocket %s can't be used, "
+          "fetching from this server over TCP.",
+          native_fetcher_loopback_socket_.c_str());
+    }
     ngx_url_async_fetchers_.push_back(fetcher);
     return fetcher;
   } else {
@@ -188,10 +214,68 @@ ServerContext* NgxRewriteDriverFactory::NewServerContext() {
   return NULL;
 }
 
+NgxSharedUrlTable* NgxRewriteDriverFactory::CreateSharedUrlTable(
+    StringPiece name, int num_slots) {
+  if (num_slots <= 0) {
+    return NULL;
+  }
+  scoped_ptr<NgxSharedUrlTable> table(
+      new NgxSharedUrlTable(shared_mem_runtime(), name, num_slots));
+  if (!table->Initialize(message_handler())) {
+    return NULL;
+  }
+  return table.release();
+}
+
+void NgxRewriteDriverFactory::RootInit() {
+  SystemRewriteDriverFactory::RootInit();
+  ipro_negative_index_.reset(CreateSharedUrlTable(
+      "ngx_ipro_negative_index", ipro_negative_index_slots_));
+  ipro_recordings_.reset(CreateSharedUrlTable(
+      "ngx_ipro_recordings", ipro_recording_slots_));
+  owns_shared_tables_ = true;
+}
+
+void NgxRewriteDriverFactory::ChildInit() {
+  SystemRewriteDriverFactory::ChildInit();
+  NgxConnection::InitPool(statistics(),
+                          native_fetcher_max_idle_connections_,
+                          native_fetcher_max_idle_connections_per_origin_);
+  NgxDnsCache::Init(statistics());
+  owns_shared_tables_ = false;
+  if (ipro_negative_index_.get() != NULL &&
+      !ipro_negative_index_->Attach(message_handler())) {
+    ipro_negative_index_.reset(NULL);
+  }
+  if (ipro_recordings_.get() != NULL &&
+      !ipro_recordings_->Attach(message_handler())) {
+    ipro_recordings_.reset(NULL);
+  }
+}
+
+void NgxRewriteDriverFactory::AddPlatformSpecificRewritePasses(
+    RewriteDriver* driver) {
+  SystemRewriteDriverFactory::AddPlatformSpecificRewritePasses(driver);
+  const NgxRewriteOptions* options =
+      NgxRewriteOptions::DynamicCast(driver->options());
+  if (options != NULL &&
+      (options->preload_link_headers() || options->early_hints())) {
+    driver->AddOwnedPostRenderFilter(new NgxPreloadHintsFilter(driver));
+  }
+}
+
 void NgxRewriteDriverFactory::ShutDown() {
   if (!shut_down_) {
     shut_down_ = true;
     SystemRewriteDriverFactory::ShutDown();
+    if (owns_shared_tables_) {
+      if (ipro_negative_index_.get() != NULL) {
+        ipro_negative_index_->GlobalCleanup(message_handler());
+      }
+      if (ipro_recordings_.get() != NULL) {
+        ipro_recordings_->GlobalCleanup(message_handler());
+      }
+    }
   }
 }
 
@@ -266,6 +350,9 @@ void NgxRewriteDriverFactory::InitStats(Statistics* statistics) {
 
   // Init Ngx-specific stats.
   NgxServerContext::InitStats(statistics);
+  NgxConnection::InitStats(statistics);
+  NgxDnsCache::InitStats(statistics);
+  NgxUrlAsyncFetcher::InitStats(statistics);
   InPlaceResourceRecorder::InitStats(statistics);
 }
 
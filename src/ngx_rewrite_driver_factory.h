@@ -37,6 +37,8 @@ extern "C" {
 
 #include "pagespeed/kernel/base/md5_hasher.h"
 #include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/timer.h"
 #include "pagespeed/system/system_rewrite_driver_factory.h"
 
 namespace net_instaweb {
@@ -44,7 +46,9 @@ namespace net_instaweb {
 class NgxMessageHandler;
 class NgxRewriteOptions;
 class NgxServerContext;
+class NgxSharedUrlTable;
 class NgxUrlAsyncFetcher;
+class RewriteDriver;
 class SharedCircularBuffer;
 class SharedMemRefererStatistics;
 class SlowWorker;
@@ -85,6 +89,12 @@ class NgxRewriteDriverFactory : public SystemRewriteDriverFactory {
   static void InitStats(Statistics* statistics);
   NgxServerContext* MakeNgxServerContext(StringPiece hostname, int port);
   virtual ServerContext* NewServerContext();
+  // Set up and attach to the shared tables below, in addition to what
+  // SystemRewriteDriverFactory does.
+  virtual void RootInit();
+  virtual void ChildInit();
+  // Adds NgxPreloadHintsFilter when PreloadLinkHeaders or EarlyHints is on.
+  virtual void AddPlatformSpecificRewritePasses(RewriteDriver* driver);
   virtual void ShutDown();
 
   // Starts pagespeed threads if they've not been started already.  Must be
@@ -121,6 +131,50 @@ class NgxRewriteDriverFactory : public SystemRewriteDriverFactory {
   void set_native_fetcher_max_keepalive_requests(int x) {
     native_fetcher_max_keepalive_requests_ = x;
   }
+  void set_native_fetcher_max_idle_connections(int x) {
+    native_fetcher_max_idle_connections_ = x;
+  }
+  void set_native_fetcher_max_idle_connections_per_origin(int x) {
+    native_fetcher_max_idle_connections_per_origin_ = x;
+  }
+  void set_native_fetcher_max_fetches_per_origin(int x) {
+    native_fetcher_max_fetches_per_origin_ = x;
+  }
+  void set_native_fetcher_slow_origins_interval_sec(int x) {
+    native_fetcher_slow_origins_interval_sec_ = x;
+  }
+  void add_native_fetcher_upstream(StringPiece name) {
+    GoogleString upstream;
+    name.CopyToString(&upstream);
+    LowerString(&upstream);
+    native_fetcher_upstreams_.insert(upstream);
+  }
+  void set_native_fetcher_loopback_socket(StringPiece path) {
+    path.CopyToString(&native_fetcher_loopback_socket_);
+  }
+  void set_ipro_negative_index_slots(int x) {
+    ipro_negative_index_slots_ = x;
+  }
+  void set_ipro_negative_index_ttl_sec(int x) {
+    ipro_negative_index_ttl_sec_ = x;
+  }
+  int64 ipro_negative_index_ttl_ms() {
+    return ipro_negative_index_ttl_sec_ * Timer::kSecondMs;
+  }
+  void set_ipro_recording_slots(int x) {
+    ipro_recording_slots_ = x;
+  }
+  // Urls IPRO found it couldn't rewrite, shared by all workers.  NULL unless
+  // IproNegativeIndexSlots is set.  Cache flushes and purges don't clear it:
+  // entries only go away after IproNegativeIndexTtlSec.
+  NgxSharedUrlTable* ipro_negative_index() {
+    return ipro_negative_index_.get();
+  }
+  // Urls some worker is currently recording for IPRO.  NULL unless
+  // IproRecordingSlots is set.
+  NgxSharedUrlTable* ipro_recordings() {
+    return ipro_recordings_.get();
+  }
   ProcessScriptVariablesMode process_script_variables() {
     return process_script_variables_mode_;
   }
@@ -157,6 +211,23 @@ class NgxRewriteDriverFactory : public SystemRewriteDriverFactory {
   ngx_resolver_t* resolver_;
   bool use_native_fetcher_;
   int native_fetcher_max_keepalive_requests_;
+  int native_fetcher_max_idle_connections_;
+  int native_fetcher_max_idle_connections_per_origin_;
+  int native_fetcher_max_fetches_per_origin_;
+  int native_fetcher_slow_origins_interval_sec_;
+  std::set<GoogleString> native_fetcher_upstreams_;
+  GoogleString native_fetcher_loopback_socket_;
+  int ipro_negative_index_slots_;
+  int ipro_negative_index_ttl_sec_;
+  scoped_ptr<NgxSharedUrlTable> ipro_negative_index_;
+  int ipro_recording_slots_;
+  scoped_ptr<NgxSharedUrlTable> ipro_recordings_;
+  // True in the process that created the shared tables, and is responsible
+  // for destroying them.
+  bool owns_shared_tables_;
+
+  // Returns a new, initialized NgxSharedUrlTable, or NULL if that fails.
+  NgxSharedUrlTable* CreateSharedUrlTable(StringPiece name, int num_slots);
 
   typedef std::set<NgxMessageHandler*> NgxMessageHandlerSet;
   NgxMessageHandlerSet server_context_message_handlers_;
@@ -47,6 +47,15 @@ const char kConsolePath[] = "ConsolePath";
 const char kMessagesPath[] = "MessagesPath";
 const char kAdminPath[] = "AdminPath";
 const char kGlobalAdminPath[] = "GlobalAdminPath";
+const char kHtmlOutputCacheSizeKb[] = "HtmlOutputCacheSizeKb";
+const char kHtmlOutputCacheTtlSec[] = "HtmlOutputCacheTtlSec";
+const char kHtmlRewriteMaxContentLength[] = "HtmlRewriteMaxContentLength";
+const char kHtmlRewriteDeadlineMs[] = "HtmlRewriteDeadlineMs";
+const char kPreloadLinkHeaders[] = "PreloadLinkHeaders";
+const char kEarlyHints[] = "EarlyHints";
+const char kResourceHotCacheSizeKb[] = "ResourceHotCacheSizeKb";
+const char kResourceNotModifiedFastPath[] = "ResourceNotModifiedFastPath";
+const char kSendfileResourceMinSizeKb[] = "SendfileResourceMinSizeKb";
 
 // These options are copied from mod_instaweb.cc, where APACHE_CONFIG_OPTIONX
 // indicates that they can not be set at the directory/location level. They set
@@ -76,13 +85,31 @@ const char* const server_only_options[] = {
   "LoadFromFileRule",
   "LoadFromFileRuleMatch",
   "UseNativeFetcher",
-  "NativeFetcherMaxKeepaliveRequests"
+  "NativeFetcherMaxKeepaliveRequests",
+  "NativeFetcherMaxIdleConnections",
+  "NativeFetcherMaxIdleConnectionsPerOrigin",
+  "NativeFetcherMaxFetchesPerOrigin",
+  "NativeFetcherSlowOriginsIntervalSec",
+  "NativeFetcherUpstream",
+  "NativeFetcherLoopbackSocket",
+  "IproNegativeIndexSlots",
+  "IproNegativeIndexTtlSec",
+  "IproRecordingSlots"
 };
 
 // Options that can only be used in the main (http) option scope.
 const char* const main_only_options[] = {
   "UseNativeFetcher",
-  "NativeFetcherMaxKeepaliveRequests"
+  "NativeFetcherMaxKeepaliveRequests",
+  "NativeFetcherMaxIdleConnections",
+  "NativeFetcherMaxIdleConnectionsPerOrigin",
+  "NativeFetcherMaxFetchesPerOrigin",
+  "NativeFetcherSlowOriginsIntervalSec",
+  "NativeFetcherUpstream",
+  "NativeFetcherLoopbackSocket",
+  "IproNegativeIndexSlots",
+  "IproNegativeIndexTtlSec",
+  "IproRecordingSlots"
 };
 
 }  // namespace
@@ -133,6 +160,55 @@ void NgxRewriteOptions::AddProperties() {
       kProcessScopeStrict,
       "Set the global admin path.  Ex: /pagespeed_global_admin",
       false);
+  add_ngx_option(
+      0, &NgxRewriteOptions::html_output_cache_size_kb_, "nhocs",
+      kHtmlOutputCacheSizeKb, kServerScope,
+      "Size of the per-worker cache of rewritten html for anonymous "
+      "requests, in kilobytes.  0 disables the cache.", true);
+  add_ngx_option(
+      300, &NgxRewriteOptions::html_output_cache_ttl_sec_, "nhoct",
+      kHtmlOutputCacheTtlSec, kServerScope,
+      "How long rewritten html stays in the html output cache, in seconds.",
+      true);
+  add_ngx_option(
+      -1, &NgxRewriteOptions::html_rewrite_max_content_length_, "nhrmcl",
+      kHtmlRewriteMaxContentLength, kServerScope,
+      "Html responses with a Content-Length above this many bytes are sent "
+      "as is, without passing through pagespeed.  -1 means no limit.", true);
+  add_ngx_option(
+      -1, &NgxRewriteOptions::html_rewrite_deadline_ms_, "nhrdm",
+      kHtmlRewriteDeadlineMs, kServerScope,
+      "If pagespeed hasn't started sending rewritten html this many "
+      "milliseconds after the response headers arrived, send the original "
+      "html instead.  -1 means no deadline.", true);
+  add_ngx_option(
+      false, &NgxRewriteOptions::preload_link_headers_, "nplh",
+      kPreloadLinkHeaders, kServerScope,
+      "Add Link preload headers for the stylesheets, scripts and fonts seen "
+      "the last time a page was rewritten to its html responses.", true);
+  add_ngx_option(
+      false, &NgxRewriteOptions::early_hints_, "neh",
+      kEarlyHints, kServerScope,
+      "Send a 103 Early Hints response with the stylesheets, scripts and "
+      "fonts seen the last time a page was rewritten, before passing the "
+      "request on.  HTTP/1.1 only.", true);
+  add_ngx_option(
+      0, &NgxRewriteOptions::resource_hot_cache_size_kb_, "nrhcs",
+      kResourceHotCacheSizeKb, kServerScope,
+      "Size of the per-worker cache of .pagespeed. resources, in kilobytes.  "
+      "Hits are served without leaving the nginx event loop.  0 disables the "
+      "cache.", true);
+  add_ngx_option(
+      false, &NgxRewriteOptions::resource_not_modified_fast_path_, "nrnmfp",
+      kResourceNotModifiedFastPath, kServerScope,
+      "Answer conditional requests for .pagespeed. resources recently served "
+      "by this worker with a 304, without going through PageSpeed.", true);
+  add_ngx_option(
+      -1, &NgxRewriteOptions::sendfile_resource_min_size_kb_, "nsrms",
+      kSendfileResourceMinSizeKb, kServerScope,
+      "Keep .pagespeed. resources of at least this many kilobytes in files "
+      "under the FileCachePath once served, and serve them from there with "
+      "sendfile.  -1 disables this.", true);
 
   MergeSubclassProperties(ngx_properties_);
 
@@ -392,6 +468,83 @@ const char* NgxRewriteOptions::ParseAndSetOptions(
       } else {
         result = RewriteOptions::kOptionValueInvalid;
       }
+    } else if (IsDirective(directive, "NativeFetcherMaxIdleConnections")) {
+      int max_idle;
+      if (StringToInt(arg, &max_idle) && max_idle > 0) {
+        driver_factory->set_native_fetcher_max_idle_connections(max_idle);
+        result = RewriteOptions::kOptionOk;
+      } else {
+        result = RewriteOptions::kOptionValueInvalid;
+      }
+    } else if (IsDirective(directive,
+                           "NativeFetcherMaxIdleConnectionsPerOrigin")) {
+      int max_idle;
+      if (StringToInt(arg, &max_idle) && max_idle > 0) {
+        driver_factory->set_native_fetcher_max_idle_connections_per_origin(
+            max_idle);
+        result = RewriteOptions::kOptionOk;
+      } else {
+        result = RewriteOptions::kOptionValueInvalid;
+      }
+    } else if (IsDirective(directive, "NativeFetcherMaxFetchesPerOrigin")) {
+      // Defaults to 16; 0 lifts the limit.
+      int max_fetches;
+      if (StringToInt(arg, &max_fetches) && max_fetches >= 0) {
+        driver_factory->set_native_fetcher_max_fetches_per_origin(
+            max_fetches);
+        result = RewriteOptions::kOptionOk;
+      } else {
+        result = RewriteOptions::kOptionValueInvalid;
+      }
+    } else if (IsDirective(directive,
+                           "NativeFetcherSlowOriginsIntervalSec")) {
+      // How often the slowest origins get logged; defaults to 300.
+      int interval_sec;
+      if (StringToInt(arg, &interval_sec) && interval_sec > 0) {
+        driver_factory->set_native_fetcher_slow_origins_interval_sec(
+            interval_sec);
+        result = RewriteOptions::kOptionOk;
+      } else {
+        result = RewriteOptions::kOptionValueInvalid;
+      }
+    } else if (IsDirective(directive, "NativeFetcherUpstream")) {
+      // May be given once per upstream{} block.
+      driver_factory->add_native_fetcher_upstream(arg);
+      result = RewriteOptions::kOptionOk;
+    } else if (IsDirective(directive, "NativeFetcherLoopbackSocket")) {
+      // Takes the path as nginx's "listen unix:<path>;" does, prefix or not.
+      StringPiece path = arg;
+      if (StringCaseStartsWith(path, "unix:")) {
+        path.remove_prefix(STATIC_STRLEN("unix:"));
+      }
+      driver_factory->set_native_fetcher_loopback_socket(path);
+      result = RewriteOptions::kOptionOk;
+    } else if (IsDirective(directive, "IproNegativeIndexSlots")) {
+      int slots;
+      if (StringToInt(arg, &slots) && slots >= 0) {
+        driver_factory->set_ipro_negative_index_slots(slots);
+        result = RewriteOptions::kOptionOk;
+      } else {
+        result = RewriteOptions::kOptionValueInvalid;
+      }
+    } else if (IsDirective(directive, "IproNegativeIndexTtlSec")) {
+      // How long urls stay in the index.  Flushing or purging the cache
+      // doesn't remove them any sooner.
+      int ttl_sec;
+      if (StringToInt(arg, &ttl_sec) && ttl_sec > 0) {
+        driver_factory->set_ipro_negative_index_ttl_sec(ttl_sec);
+        result = RewriteOptions::kOptionOk;
+      } else {
+        result = RewriteOptions::kOptionValueInvalid;
+      }
+    } else if (IsDirective(directive, "IproRecordingSlots")) {
+      int slots;
+      if (StringToInt(arg, &slots) && slots >= 0) {
+        driver_factory->set_ipro_recording_slots(slots);
+        result = RewriteOptions::kOptionOk;
+      } else {
+        result = RewriteOptions::kOptionValueInvalid;
+      }
     } else if (StringCaseEqual("ProcessScriptVariables", args[0])) {
       if (scope == RewriteOptions::kProcessScopeStrict) {
         ProcessScriptVariablesMode mode;
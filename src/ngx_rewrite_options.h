@@ -169,6 +169,33 @@ class NgxRewriteOptions : public SystemRewriteOptions {
   const GoogleString& global_admin_path() const {
     return global_admin_path_.value();
   }
+  int64 html_output_cache_size_kb() const {
+    return html_output_cache_size_kb_.value();
+  }
+  int64 html_output_cache_ttl_sec() const {
+    return html_output_cache_ttl_sec_.value();
+  }
+  int64 html_rewrite_max_content_length() const {
+    return html_rewrite_max_content_length_.value();
+  }
+  int64 html_rewrite_deadline_ms() const {
+    return html_rewrite_deadline_ms_.value();
+  }
+  bool preload_link_headers() const {
+    return preload_link_headers_.value();
+  }
+  bool early_hints() const {
+    return early_hints_.value();
+  }
+  int64 resource_hot_cache_size_kb() const {
+    return resource_hot_cache_size_kb_.value();
+  }
+  bool resource_not_modified_fast_path() const {
+    return resource_not_modified_fast_path_.value();
+  }
+  int64 sendfile_resource_min_size_kb() const {
+    return sendfile_resource_min_size_kb_.value();
+  }
   const std::vector<RefCountedPtr<ScriptLine> >& script_lines() const {
     return script_lines_;
   }
@@ -230,6 +257,15 @@ class NgxRewriteOptions : public SystemRewriteOptions {
   Option<GoogleString> messages_path_;
   Option<GoogleString> admin_path_;
   Option<GoogleString> global_admin_path_;
+  Option<int64> html_output_cache_size_kb_;
+  Option<int64> html_output_cache_ttl_sec_;
+  Option<int64> html_rewrite_max_content_length_;
+  Option<int64> html_rewrite_deadline_ms_;
+  Option<bool> preload_link_headers_;
+  Option<bool> early_hints_;
+  Option<int64> resource_hot_cache_size_kb_;
+  Option<bool> resource_not_modified_fast_path_;
+  Option<int64> sendfile_resource_min_size_kb_;
 
   bool clear_inherited_scripts_;
   std::vector<RefCountedPtr<ScriptLine> > script_lines_;
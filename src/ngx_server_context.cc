@@ -27,23 +27,183 @@ extern "C" {
 
 #include "ngx_pagespeed.h"
 #include "ngx_message_handler.h"
+#include "ngx_response_cache.h"
 #include "ngx_rewrite_driver_factory.h"
 #include "ngx_rewrite_options.h"
 #include "net/instaweb/rewriter/public/rewrite_driver.h"
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/statistics.h"
+#include "pagespeed/kernel/base/thread_system.h"
 #include "pagespeed/system/add_headers_fetcher.h"
 #include "pagespeed/system/loopback_route_fetcher.h"
 #include "pagespeed/system/system_request_context.h"
 
 namespace net_instaweb {
 
+namespace {
+
+const char kHtmlOutputCacheHits[] = "html_output_cache_hits";
+const char kHtmlOutputCacheMisses[] = "html_output_cache_misses";
+const char kHtmlOutputCacheInserts[] = "html_output_cache_inserts";
+const char kHtmlRewriteContentLengthBypasses[] =
+    "html_rewrite_content_length_bypasses";
+const char kHtmlRewriteDeadlineHits[] = "html_rewrite_deadline_hits";
+const char kIproNegativeIndexHits[] = "ipro_negative_index_hits";
+const char kIproNegativeIndexInserts[] = "ipro_negative_index_inserts";
+const char kIproRecordingsSuppressed[] = "ipro_recordings_suppressed";
+const char kResourceHotCacheHits[] = "resource_hot_cache_hits";
+const char kResourceHotCacheMisses[] = "resource_hot_cache_misses";
+const char kResourceHotCacheInserts[] = "resource_hot_cache_inserts";
+const char kResourceNotModifiedResponses[] = "resource_not_modified_responses";
+const char kResourceSendfileHits[] = "resource_sendfile_hits";
+const char kResourceSendfileInserts[] = "resource_sendfile_inserts";
+
+// Hints are small, so this is well under a megabyte.
+const size_t kPreloadHintsMaxPages = 4096;
+
+// Entries only hold a handful of headers.
+const size_t kResourceValidatorsCacheBytes = 1024 * 1024;
+// The sendfile resource store's index only holds headers and file names.
+const size_t kResourceFilesIndexBytes = 1024 * 1024;
+
+}  // namespace
+
 NgxServerContext::NgxServerContext(
     NgxRewriteDriverFactory* factory, StringPiece hostname, int port)
     : SystemServerContext(factory, hostname, port),
-      ngx_http2_variable_index_(NGX_ERROR) {
+      ngx_factory_(factory),
+      ngx_http2_variable_index_(NGX_ERROR),
+      html_output_cache_hits_(NULL),
+      html_output_cache_misses_(NULL),
+      html_output_cache_inserts_(NULL),
+      html_rewrite_content_length_bypasses_(NULL),
+      html_rewrite_deadline_hits_(NULL),
+      ipro_negative_index_hits_(NULL),
+      ipro_negative_index_inserts_(NULL),
+      ipro_recordings_suppressed_(NULL),
+      resource_hot_cache_hits_(NULL),
+      resource_hot_cache_misses_(NULL),
+      resource_hot_cache_inserts_(NULL),
+      resource_not_modified_responses_(NULL),
+      resource_sendfile_hits_(NULL),
+      resource_sendfile_inserts_(NULL),
+      preload_hints_enabled_(false),
+      preload_hints_mutex_(thread_system()->NewMutex()) {
 }
 
 NgxServerContext::~NgxServerContext() { }
 
+void NgxServerContext::InitStats(Statistics* statistics) {
+  SystemServerContext::InitStats(statistics);
+  statistics->AddVariable(kHtmlOutputCacheHits);
+  statistics->AddVariable(kHtmlOutputCacheMisses);
+  statistics->AddVariable(kHtmlOutputCacheInserts);
+  statistics->AddVariable(kHtmlRewriteContentLengthBypasses);
+  statistics->AddVariable(kHtmlRewriteDeadlineHits);
+  statistics->AddVariable(kIproNegativeIndexHits);
+  statistics->AddVariable(kIproNegativeIndexInserts);
+  statistics->AddVariable(kIproRecordingsSuppressed);
+  statistics->AddVariable(kResourceHotCacheHits);
+  statistics->AddVariable(kResourceHotCacheMisses);
+  statistics->AddVariable(kResourceHotCacheInserts);
+  statistics->AddVariable(kResourceNotModifiedResponses);
+  statistics->AddVariable(kResourceSendfileHits);
+  statistics->AddVariable(kResourceSendfileInserts);
+}
+
+void NgxServerContext::InitWorker() {
+  Statistics* stats = statistics();
+  html_output_cache_hits_ = stats->GetVariable(kHtmlOutputCacheHits);
+  html_output_cache_misses_ = stats->GetVariable(kHtmlOutputCacheMisses);
+  html_output_cache_inserts_ = stats->GetVariable(kHtmlOutputCacheInserts);
+  html_rewrite_content_length_bypasses_ =
+      stats->GetVariable(kHtmlRewriteContentLengthBypasses);
+  html_rewrite_deadline_hits_ = stats->GetVariable(kHtmlRewriteDeadlineHits);
+  ipro_negative_index_hits_ = stats->GetVariable(kIproNegativeIndexHits);
+  ipro_negative_index_inserts_ = stats->GetVariable(kIproNegativeIndexInserts);
+  ipro_recordings_suppressed_ = stats->GetVariable(kIproRecordingsSuppressed);
+  resource_hot_cache_hits_ = stats->GetVariable(kResourceHotCacheHits);
+  resource_hot_cache_misses_ = stats->GetVariable(kResourceHotCacheMisses);
+  resource_hot_cache_inserts_ = stats->GetVariable(kResourceHotCacheInserts);
+  resource_not_modified_responses_ =
+      stats->GetVariable(kResourceNotModifiedResponses);
+  resource_sendfile_hits_ = stats->GetVariable(kResourceSendfileHits);
+  resource_sendfile_inserts_ = stats->GetVariable(kResourceSendfileInserts);
+
+  int64 html_output_cache_size_kb = config()->html_output_cache_size_kb();
+  if (html_output_cache_size_kb > 0) {
+    html_output_cache_.reset(
+        new NgxResponseCache(html_output_cache_size_kb * 1024));
+  }
+
+  int64 resource_hot_cache_size_kb = config()->resource_hot_cache_size_kb();
+  if (resource_hot_cache_size_kb > 0) {
+    resource_hot_cache_.reset(
+        new NgxResponseCache(resource_hot_cache_size_kb * 1024));
+  }
+
+  if (config()->resource_not_modified_fast_path()) {
+    resource_validators_.reset(
+        new NgxResponseCache(kResourceValidatorsCacheBytes));
+  }
+
+  if (config()->sendfile_resource_min_size_kb() >= 0 &&
+      !config()->file_cache_path().empty()) {
+    resource_files_dir_ = StrCat(config()->file_cache_path(), "/ngx_sendfile");
+    if (file_system()->RecursivelyMakeDir(resource_files_dir_,
+                                          message_handler())) {
+      resource_files_.reset(new NgxResponseCache(kResourceFilesIndexBytes));
+    }
+  }
+
+  preload_hints_enabled_ =
+      config()->preload_link_headers() || config()->early_hints();
+}
+
+void NgxServerContext::SetPreloadHints(StringPiece url,
+                                       StringPiece link_header) {
+  if (!preload_hints_enabled_) {
+    return;
+  }
+  GoogleString key;
+  url.CopyToString(&key);
+  ScopedMutex lock(preload_hints_mutex_.get());
+  PreloadHintsMap::iterator iter = preload_hints_.find(key);
+  if (iter != preload_hints_.end()) {
+    preload_hints_lru_.erase(iter->second);
+    preload_hints_.erase(iter);
+  }
+  if (link_header.empty()) {
+    return;
+  }
+  preload_hints_lru_.push_front(
+      std::make_pair(key, GoogleString(link_header.data(),
+                                       link_header.size())));
+  preload_hints_[key] = preload_hints_lru_.begin();
+  if (preload_hints_lru_.size() > kPreloadHintsMaxPages) {
+    preload_hints_.erase(preload_hints_lru_.back().first);
+    preload_hints_lru_.pop_back();
+  }
+}
+
+bool NgxServerContext::GetPreloadHints(StringPiece url,
+                                       GoogleString* link_header) {
+  if (!preload_hints_enabled_) {
+    return false;
+  }
+  GoogleString key;
+  url.CopyToString(&key);
+  ScopedMutex lock(preload_hints_mutex_.get());
+  PreloadHintsMap::iterator iter = preload_hints_.find(key);
+  if (iter == preload_hints_.end()) {
+    return false;
+  }
+  preload_hints_lru_.splice(preload_hints_lru_.begin(), preload_hints_lru_,
+                            iter->second);
+  *link_header = iter->second->second;
+  return true;
+}
+
 NgxRewriteOptions* NgxServerContext::config() {
   return NgxRewriteOptions::DynamicCast(global_options());
 }
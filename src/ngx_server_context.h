@@ -24,7 +24,13 @@
 #ifndef NGX_SERVER_CONTEXT_H_
 #define NGX_SERVER_CONTEXT_H_
 
+#include <list>
+#include <map>
+#include <utility>
+
 #include "ngx_message_handler.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/string.h"
 #include "pagespeed/system/system_server_context.h"
 
 extern "C" {
@@ -33,9 +39,13 @@ extern "C" {
 
 namespace net_instaweb {
 
+class AbstractMutex;
+class NgxResponseCache;
 class NgxRewriteDriverFactory;
 class NgxRewriteOptions;
+class Statistics;
 class SystemRequestContext;
+class Variable;
 
 class NgxServerContext : public SystemServerContext {
  public:
@@ -43,6 +53,12 @@ class NgxServerContext : public SystemServerContext {
       NgxRewriteDriverFactory* factory, StringPiece hostname, int port);
   virtual ~NgxServerContext();
 
+  static void InitStats(Statistics* statistics);
+
+  // Sets up the state each worker keeps for this server context.  Called in
+  // the worker once the factory's ChildInit() is done.
+  void InitWorker();
+
   // We don't allow ProxyFetch to fetch HTML via MapProxyDomain. We will call
   // set_trusted_input() on any ProxyFetches we use to transform internal HTML.
   virtual bool ProxiesHtml() const { return false; }
@@ -69,11 +85,99 @@ class NgxServerContext : public SystemServerContext {
     return ngx_http2_variable_index_;
   }
 
+  // Rewritten html for anonymous requests, or NULL if HtmlOutputCacheSizeKb
+  // is 0.  Per worker.
+  NgxResponseCache* html_output_cache() { return html_output_cache_.get(); }
+  Variable* html_output_cache_hits() { return html_output_cache_hits_; }
+  Variable* html_output_cache_misses() { return html_output_cache_misses_; }
+  Variable* html_output_cache_inserts() { return html_output_cache_inserts_; }
+  // Html responses sent unrewritten for exceeding
+  // HtmlRewriteMaxContentLength.
+  Variable* html_rewrite_content_length_bypasses() {
+    return html_rewrite_content_length_bypasses_;
+  }
+  // Html responses sent unrewritten because HtmlRewriteDeadlineMs passed.
+  Variable* html_rewrite_deadline_hits() { return html_rewrite_deadline_hits_; }
+  // Requests the IPRO negative index let us pass on without a lookup, and
+  // urls added to it.
+  Variable* ipro_negative_index_hits() { return ipro_negative_index_hits_; }
+  Variable* ipro_negative_index_inserts() {
+    return ipro_negative_index_inserts_;
+  }
+  // IPRO recordings we skipped because another worker was recording the url.
+  Variable* ipro_recordings_suppressed() { return ipro_recordings_suppressed_; }
+
+  // Complete .pagespeed. resource responses, or NULL if
+  // ResourceHotCacheSizeKb is 0.  Per worker.
+  NgxResponseCache* resource_hot_cache() { return resource_hot_cache_.get(); }
+  Variable* resource_hot_cache_hits() { return resource_hot_cache_hits_; }
+  Variable* resource_hot_cache_misses() { return resource_hot_cache_misses_; }
+  Variable* resource_hot_cache_inserts() {
+    return resource_hot_cache_inserts_;
+  }
+  // The headers a 304 for each .pagespeed. resource recently served needs,
+  // or NULL if ResourceNotModifiedFastPath is off.  Per worker.
+  NgxResponseCache* resource_validators() {
+    return resource_validators_.get();
+  }
+  Variable* resource_not_modified_responses() {
+    return resource_not_modified_responses_;
+  }
+
+  // Index of the .pagespeed. resources kept in files under
+  // resource_files_dir() for serving with sendfile, or NULL if
+  // SendfileResourceMinSizeKb is -1.  Entries hold the file name as their
+  // body.  Per worker, though the files are shared.
+  NgxResponseCache* resource_files() { return resource_files_.get(); }
+  const GoogleString& resource_files_dir() const { return resource_files_dir_; }
+  Variable* resource_sendfile_hits() { return resource_sendfile_hits_; }
+  Variable* resource_sendfile_inserts() { return resource_sendfile_inserts_; }
+
+  // The Link header value NgxPreloadHintsFilter produced the last time it saw
+  // the page at url.  Per worker, and safe to call from any thread.  Does
+  // nothing unless PreloadLinkHeaders or EarlyHints is on.
+  void SetPreloadHints(StringPiece url, StringPiece link_header);
+  // Returns false if there are no hints for url.
+  bool GetPreloadHints(StringPiece url, GoogleString* link_header);
+
  private:
+  typedef std::list<std::pair<GoogleString, GoogleString> > PreloadHintsList;
+  typedef std::map<GoogleString, PreloadHintsList::iterator> PreloadHintsMap;
+
   NgxRewriteDriverFactory* ngx_factory_;
   // what index the "http2" var is, or NGX_ERROR.
   ngx_int_t ngx_http2_variable_index_;
 
+  scoped_ptr<NgxResponseCache> html_output_cache_;
+  Variable* html_output_cache_hits_;
+  Variable* html_output_cache_misses_;
+  Variable* html_output_cache_inserts_;
+  Variable* html_rewrite_content_length_bypasses_;
+  Variable* html_rewrite_deadline_hits_;
+  Variable* ipro_negative_index_hits_;
+  Variable* ipro_negative_index_inserts_;
+  Variable* ipro_recordings_suppressed_;
+
+  scoped_ptr<NgxResponseCache> resource_hot_cache_;
+  Variable* resource_hot_cache_hits_;
+  Variable* resource_hot_cache_misses_;
+  Variable* resource_hot_cache_inserts_;
+
+  scoped_ptr<NgxResponseCache> resource_validators_;
+  Variable* resource_not_modified_responses_;
+
+  scoped_ptr<NgxResponseCache> resource_files_;
+  GoogleString resource_files_dir_;
+  Variable* resource_sendfile_hits_;
+  Variable* resource_sendfile_inserts_;
+
+  // Link header values by page url, most recently used first.  Protected by
+  // preload_hints_mutex_, as pages finish rewriting on pagespeed's threads.
+  bool preload_hints_enabled_;
+  scoped_ptr<AbstractMutex> preload_hints_mutex_;
+  PreloadHintsList preload_hints_lru_;
+  PreloadHintsMap preload_hints_;
+
   DISALLOW_COPY_AND_ASSIGN(NgxServerContext);
 };
 
@@ -0,0 +1,188 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+
+
+#include "ngx_shared_url_table.h"
+
+#include <cstring>
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/abstract_shared_mem.h"
+#include "pagespeed/kernel/base/message_handler.h"
+
+namespace net_instaweb {
+
+NgxSharedUrlTable::NgxSharedUrlTable(AbstractSharedMem* shm_runtime,
+                                     StringPiece name, int num_slots)
+    : shm_runtime_(shm_runtime),
+      name_(name.as_string()),
+      num_slots_(num_slots) {
+  CHECK_GT(num_slots, 0);
+}
+
+NgxSharedUrlTable::~NgxSharedUrlTable() {
+  // The mutex lives in the segment, so it has to go first.
+  mutex_.reset(NULL);
+  segment_.reset(NULL);
+}
+
+size_t NgxSharedUrlTable::SegmentSize() const {
+  return shm_runtime_->SharedMutexSize() + num_slots_ * sizeof(Slot);
+}
+
+NgxSharedUrlTable::Slot* NgxSharedUrlTable::slots() {
+  return reinterpret_cast<Slot*>(const_cast<char*>(
+      segment_->Base() + shm_runtime_->SharedMutexSize()));
+}
+
+bool NgxSharedUrlTable::Initialize(MessageHandler* handler) {
+  segment_.reset(shm_runtime_->CreateSegment(name_, SegmentSize(), handler));
+  if (segment_.get() == NULL) {
+    handler->Message(kError, "Could not create shared memory for %s",
+                     name_.c_str());
+    return false;
+  }
+  if (!segment_->InitializeSharedMutex(0, handler)) {
+    handler->Message(kError, "Could not create the shared mutex for %s",
+                     name_.c_str());
+    segment_.reset(NULL);
+    return false;
+  }
+  memset(slots(), 0, num_slots_ * sizeof(Slot));
+  mutex_.reset(segment_->AttachToSharedMutex(0));
+  return true;
+}
+
+bool NgxSharedUrlTable::Attach(MessageHandler* handler) {
+  // In the root process mutex_ and segment_ refer to the root's attachment;
+  // drop those first.
+  mutex_.reset(NULL);
+  segment_.reset(
+      shm_runtime_->AttachToSegment(name_, SegmentSize(), handler));
+  if (segment_.get() == NULL) {
+    handler->Message(kError, "Could not attach to shared memory for %s",
+                     name_.c_str());
+    return false;
+  }
+  mutex_.reset(segment_->AttachToSharedMutex(0));
+  return true;
+}
+
+void NgxSharedUrlTable::GlobalCleanup(MessageHandler* handler) {
+  if (segment_.get() != NULL) {
+    mutex_.reset(NULL);
+    segment_.reset(NULL);
+    shm_runtime_->DestroySegment(name_, handler);
+  }
+}
+
+uint64 NgxSharedUrlTable::Hash(StringPiece key) {
+  // 64-bit FNV-1a.
+  uint64 hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < key.size(); ++i) {
+    hash ^= static_cast<unsigned char>(key[i]);
+    hash *= 1099511628211ULL;
+  }
+  // 0 marks empty slots.
+  return hash == 0 ? 1 : hash;
+}
+
+NgxSharedUrlTable::Slot* NgxSharedUrlTable::FindSlot(
+    uint64 key, int64 now_ms, bool* found) {
+  Slot* table = slots();
+  Slot* free_slot = NULL;
+  Slot* oldest_slot = NULL;
+  int start = key % num_slots_;
+  for (int i = 0; i < kMaxProbes && i < num_slots_; ++i) {
+    Slot* slot = &table[(start + i) % num_slots_];
+    bool live = slot->key != 0 && slot->expiration_ms > now_ms;
+    if (live && slot->key == key) {
+      *found = true;
+      return slot;
+    }
+    if (!live) {
+      if (free_slot == NULL) {
+        free_slot = slot;
+      }
+    } else if (oldest_slot == NULL ||
+               slot->expiration_ms < oldest_slot->expiration_ms) {
+      oldest_slot = slot;
+    }
+  }
+  *found = false;
+  return free_slot != NULL ? free_slot : oldest_slot;
+}
+
+bool NgxSharedUrlTable::Lookup(uint64 key, int64 now_ms) {
+  if (mutex_.get() == NULL) {
+    return false;
+  }
+  ScopedMutex lock(mutex_.get());
+  bool found;
+  FindSlot(key, now_ms, &found);
+  return found;
+}
+
+void NgxSharedUrlTable::Insert(uint64 key, int64 expiration_ms,
+                               int64 now_ms) {
+  if (mutex_.get() == NULL) {
+    return;
+  }
+  ScopedMutex lock(mutex_.get());
+  bool found;
+  Slot* slot = FindSlot(key, now_ms, &found);
+  slot->key = key;
+  slot->expiration_ms = expiration_ms;
+}
+
+NgxSharedUrlTable::InsertResult NgxSharedUrlTable::InsertIfAbsent(
+    uint64 key, int64 expiration_ms, int64 now_ms) {
+  if (mutex_.get() == NULL) {
+    return kNoRoom;
+  }
+  ScopedMutex lock(mutex_.get());
+  bool found;
+  Slot* slot = FindSlot(key, now_ms, &found);
+  if (found) {
+    return kPresent;
+  }
+  if (slot->key != 0 && slot->expiration_ms > now_ms) {
+    return kNoRoom;
+  }
+  slot->key = key;
+  slot->expiration_ms = expiration_ms;
+  return kInserted;
+}
+
+void NgxSharedUrlTable::Erase(uint64 key, int64 expiration_ms) {
+  if (mutex_.get() == NULL) {
+    return;
+  }
+  ScopedMutex lock(mutex_.get());
+  bool found;
+  Slot* slot = FindSlot(key, 0, &found);
+  if (found && slot->expiration_ms == expiration_ms) {
+    slot->key = 0;
+  }
+}
+
+}  // namespace net_instaweb
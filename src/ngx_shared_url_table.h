@@ -0,0 +1,109 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+
+//
+// NgxSharedUrlTable is a fixed-size table of 64-bit url hashes with
+// expiration times, kept in shared memory so all nginx workers see the same
+// entries.  It's created in the root process before nginx forks, and attached
+// to in each worker.  Collisions only ever make the table forget entries
+// early: each key can live in a small window of slots, and when the window is
+// full Insert() replaces the entry that expires first.
+
+#ifndef NGX_SHARED_URL_TABLE_H_
+#define NGX_SHARED_URL_TABLE_H_
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+
+namespace net_instaweb {
+
+class AbstractMutex;
+class AbstractSharedMem;
+class AbstractSharedMemSegment;
+class MessageHandler;
+
+class NgxSharedUrlTable {
+ public:
+  enum InsertResult {
+    kInserted,
+    // key is in the table already.
+    kPresent,
+    // All the slots key could go in hold other live entries.
+    kNoRoom,
+  };
+
+  // Doesn't take ownership of shm_runtime.  name must be unique within it.
+  NgxSharedUrlTable(AbstractSharedMem* shm_runtime, StringPiece name,
+                    int num_slots);
+  ~NgxSharedUrlTable();
+
+  // Creates the segment.  Call in the root process, before forking.
+  bool Initialize(MessageHandler* handler);
+  // Attaches to the segment Initialize() created.  Call in each worker.
+  bool Attach(MessageHandler* handler);
+  // Destroys the segment.  Call in the root process when shutting down.
+  void GlobalCleanup(MessageHandler* handler);
+
+  static uint64 Hash(StringPiece key);
+
+  // Until Initialize() or Attach() succeeds, the table is always empty and
+  // ignores updates.
+
+  // Returns true if key is in the table and expires after now_ms.
+  bool Lookup(uint64 key, int64 now_ms);
+  // Adds key, or updates its expiration time.
+  void Insert(uint64 key, int64 expiration_ms, int64 now_ms);
+  // Adds key if it isn't in the table already.  Unlike Insert(), never replaces
+  // another live entry to make room.
+  InsertResult InsertIfAbsent(uint64 key, int64 expiration_ms, int64 now_ms);
+  // Removes key if its entry still expires at expiration_ms, that is, it's
+  // still the one we inserted and hasn't been replaced since.
+  void Erase(uint64 key, int64 expiration_ms);
+
+ private:
+  struct Slot {
+    uint64 key;  // 0 for an empty slot.
+    int64 expiration_ms;
+  };
+
+  // How many slots starting at key % num_slots_ a key may be stored in.
+  static const int kMaxProbes = 8;
+
+  size_t SegmentSize() const;
+  Slot* slots();
+  // Returns the slot holding key, setting *found, or else the slot key should
+  // be stored in.  mutex_ must be held.
+  Slot* FindSlot(uint64 key, int64 now_ms, bool* found);
+
+  AbstractSharedMem* shm_runtime_;
+  const GoogleString name_;
+  const int num_slots_;
+  scoped_ptr<AbstractSharedMemSegment> segment_;
+  scoped_ptr<AbstractMutex> mutex_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxSharedUrlTable);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_SHARED_URL_TABLE_H_
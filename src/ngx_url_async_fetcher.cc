@@ -29,9 +29,11 @@ extern "C" {
 
 #include <vector>
 #include <algorithm>
+#include <functional>
 #include <string>
 #include <list>
 #include <map>
+#include <new>
 #include <set>
 
 #include "net/instaweb/http/public/async_fetch.h"
@@ -47,12 +49,132 @@ extern "C" {
 #include "pagespeed/kernel/base/thread_system.h"
 #include "pagespeed/kernel/base/timer.h"
 #include "pagespeed/kernel/base/writer.h"
+#include "pagespeed/kernel/http/google_url.h"
+#include "pagespeed/kernel/http/http_names.h"
 #include "pagespeed/kernel/http/request_headers.h"
 #include "pagespeed/kernel/http/response_headers.h"
 #include "pagespeed/kernel/http/response_headers_parser.h"
 
 namespace net_instaweb {
 
+  namespace {
+
+  const char kSslHandshakes[] = "native_fetcher_ssl_handshakes";
+  const char kSslSessionReuses[] = "native_fetcher_ssl_session_reuses";
+  const char kCoalescedFetches[] = "native_fetcher_coalesced_fetches";
+  const char kQueuedFetches[] = "native_fetcher_queued_fetches";
+  const char kUpstreamFetches[] = "native_fetcher_upstream_fetches";
+  const char kLoopbackFetches[] = "native_fetcher_loopback_fetches";
+  const char kRemoteFetches[] = "native_fetcher_remote_fetches";
+
+  // By NgxUrlAsyncFetcher::FetchPhase.
+  const char* const kPhaseHistograms[] = {
+    "native_fetcher_dns_ms",
+    "native_fetcher_connect_ms",
+    "native_fetcher_write_request_ms",
+    "native_fetcher_first_byte_ms",
+    "native_fetcher_body_ms"
+  };
+  const char* const kPhaseNames[] = {
+    "dns", "connect", "write", "first byte", "body"
+  };
+
+  // How often we report the slowest origins by default, and how many of them.
+  const int64 kSlowOriginsIntervalMs = 5 * Timer::kMinuteMs;
+  const int kSlowOriginsReported = 5;
+  // Origins we keep timings for between reports.
+  const size_t kMaxTimedOrigins = 1000;
+
+  // How many finished fetches, and their pools, we keep around for re-use.
+  const size_t kMaxFreeFetches = 64;
+  // What fetches start their pools with.
+  const size_t kFetchPoolSize = 12288;
+
+  // Origins we remember TLS sessions for, per worker.
+  const size_t kMaxSslSessions = 1000;
+
+  }  // namespace
+
+  class NgxUrlAsyncFetcher::CoalescedFetch : public AsyncFetch {
+   public:
+    CoalescedFetch(NgxUrlAsyncFetcher* fetcher, const GoogleString& key,
+                   AsyncFetch* first)
+        : AsyncFetch(first->request_context()),
+          fetcher_(fetcher),
+          fetch_(NULL),
+          key_(key),
+          detached_(false) {
+      request_headers()->CopyFrom(*first->request_headers());
+      waiters_.push_back(first);
+    }
+
+    // These must be called with fetcher_->mutex_ held.
+    void set_fetch(NgxFetch* fetch) { fetch_ = fetch; }
+    void AddWaiter(AsyncFetch* fetch) {
+      waiters_.push_back(fetch);
+      // Someone's waiting on it now.
+      if (!fetch->IsBackgroundFetch()) {
+        fetch_->set_background(false);
+      }
+    }
+
+   protected:
+    virtual void HandleHeadersComplete() {
+      // Late arrivals would have missed the headers, so they fetch on their
+      // own from here on.  That also keeps waiters_ stable.
+      Detach();
+      for (int i = 0, n = waiters_.size(); i < n; ++i) {
+        waiters_[i]->response_headers()->CopyFrom(*response_headers());
+        waiters_[i]->HeadersComplete();
+      }
+    }
+
+    virtual bool HandleWrite(const StringPiece& sp, MessageHandler* handler) {
+      // Carry on as long as anyone still wants the body.
+      bool ok = false;
+      for (int i = 0, n = waiters_.size(); i < n; ++i) {
+        ok = waiters_[i]->Write(sp, handler) || ok;
+      }
+      return ok;
+    }
+
+    virtual bool HandleFlush(MessageHandler* handler) {
+      for (int i = 0, n = waiters_.size(); i < n; ++i) {
+        waiters_[i]->Flush(handler);
+      }
+      return true;
+    }
+
+    virtual void HandleDone(bool success) {
+      Detach();
+      for (int i = 0, n = waiters_.size(); i < n; ++i) {
+        if (extra_response_headers()->NumAttributes() > 0) {
+          waiters_[i]->extra_response_headers()->CopyFrom(
+              *extra_response_headers());
+        }
+        waiters_[i]->Done(success);
+      }
+      delete this;
+    }
+
+   private:
+    void Detach() {
+      ScopedMutex lock(fetcher_->mutex_);
+      if (!detached_) {
+        fetcher_->coalesced_fetches_.erase(key_);
+        detached_ = true;
+      }
+    }
+
+    NgxUrlAsyncFetcher* fetcher_;
+    NgxFetch* fetch_;
+    const GoogleString key_;
+    bool detached_;
+    std::vector<AsyncFetch*> waiters_;
+
+    DISALLOW_COPY_AND_ASSIGN(CoalescedFetch);
+  };
+
   NgxUrlAsyncFetcher::NgxUrlAsyncFetcher(const char* proxy,
                                          ngx_log_t* log,
                                          ngx_msec_t resolver_timeout,
@@ -60,6 +182,7 @@ namespace net_instaweb {
                                          ngx_resolver_t* resolver,
                                          int max_keepalive_requests,
                                          ThreadSystem* thread_system,
+                                         Statistics* statistics,
                                          MessageHandler* handler)
     : fetchers_count_(0),
       shutdown_(false),
@@ -69,7 +192,28 @@ namespace net_instaweb {
       message_handler_(handler),
       mutex_(NULL),
       max_keepalive_requests_(max_keepalive_requests),
-      event_connection_(NULL) {
+      event_connection_(NULL),
+      max_fetches_per_origin_(0),
+      loopback_socklen_(0),
+      origin_timings_start_ms_(0),
+      slow_origins_interval_ms_(kSlowOriginsIntervalMs),
+      https_enabled_(false),
+      allow_self_signed_(false),
+      allow_unknown_certificate_authority_(false),
+      allow_certificate_not_yet_valid_(false),
+#if (NGX_SSL)
+      ssl_(NULL),
+#endif
+      ssl_handshakes_(statistics->GetVariable(kSslHandshakes)),
+      ssl_session_reuses_(statistics->GetVariable(kSslSessionReuses)),
+      coalesced_fetches_count_(statistics->GetVariable(kCoalescedFetches)),
+      queued_fetches_count_(statistics->GetUpDownCounter(kQueuedFetches)),
+      upstream_fetches_(statistics->GetVariable(kUpstreamFetches)),
+      loopback_fetches_(statistics->GetVariable(kLoopbackFetches)),
+      remote_fetches_(statistics->GetVariable(kRemoteFetches)) {
+    for (int i = 0; i < kNumFetchPhases; ++i) {
+      phase_histograms_[i] = statistics->GetHistogram(kPhaseHistograms[i]);
+    }
     resolver_timeout_ = resolver_timeout;
     fetch_timeout_ = fetch_timeout;
     ngx_memzero(&proxy_, sizeof(proxy_));
@@ -98,8 +242,32 @@ namespace net_instaweb {
 
     CancelActiveFetches();
     active_fetches_.DeleteAll();
+    // These hand their pools back to us, so do it while we're still whole.
+    completed_fetches_.DeleteAll();
+    pending_fetches_.DeleteAll();
     NgxConnection::Terminate();
 
+    for (size_t i = 0; i < free_fetches_.size(); ++i) {
+      ::operator delete(free_fetches_[i]);
+    }
+    free_fetches_.clear();
+    for (size_t i = 0; i < free_pools_.size(); ++i) {
+      ngx_destroy_pool(free_pools_[i]);
+    }
+    free_pools_.clear();
+
+#if (NGX_SSL)
+    for (std::map<GoogleString, ngx_ssl_session_t*>::iterator p =
+             ssl_sessions_.begin(); p != ssl_sessions_.end(); ++p) {
+      ngx_ssl_free_session(p->second);
+    }
+    ssl_sessions_.clear();
+    if (ssl_ != NULL) {
+      ngx_ssl_cleanup_ctx(ssl_);
+      ssl_ = NULL;
+    }
+#endif
+
     if (pool_ != NULL) {
       ngx_destroy_pool(pool_);
       pool_ = NULL;
@@ -110,6 +278,155 @@ namespace net_instaweb {
     }
   }
 
+  void NgxUrlAsyncFetcher::InitStats(Statistics* statistics) {
+    statistics->AddVariable(kSslHandshakes);
+    statistics->AddVariable(kSslSessionReuses);
+    statistics->AddVariable(kCoalescedFetches);
+    statistics->AddUpDownCounter(kQueuedFetches);
+    statistics->AddVariable(kUpstreamFetches);
+    statistics->AddVariable(kLoopbackFetches);
+    statistics->AddVariable(kRemoteFetches);
+    for (int i = 0; i < kNumFetchPhases; ++i) {
+      statistics->AddHistogram(kPhaseHistograms[i]);
+    }
+  }
+
+  bool NgxUrlAsyncFetcher::SupportsHttps() const {
+#if (NGX_SSL)
+    return https_enabled_;
+#else
+    return false;
+#endif
+  }
+
+  bool NgxUrlAsyncFetcher::SetHttpsOptions(StringPiece options) {
+    https_enabled_ = false;
+    allow_self_signed_ = false;
+    allow_unknown_certificate_authority_ = false;
+    allow_certificate_not_yet_valid_ = false;
+    StringPieceVector v;
+    SplitStringPieceToVector(options, ",", &v, true);
+    bool ok = true;
+    for (int i = 0, n = v.size(); i < n; ++i) {
+      StringPiece option = v[i];
+      TrimWhitespace(&option);
+      if (option == "enable") {
+        https_enabled_ = true;
+      } else if (option == "disable") {
+        https_enabled_ = false;
+      } else if (option == "allow_self_signed") {
+        allow_self_signed_ = true;
+      } else if (option == "allow_unknown_certificate_authority") {
+        allow_unknown_certificate_authority_ = true;
+      } else if (option == "allow_certificate_not_yet_valid") {
+        allow_certificate_not_yet_valid_ = true;
+      } else {
+        ok = false;
+      }
+    }
+    return ok;
+  }
+
+#if (NGX_SSL)
+  bool NgxUrlAsyncFetcher::InitSsl() {
+    if (ssl_ != NULL) {
+      return true;
+    }
+    ngx_ssl_t* ssl = static_cast<ngx_ssl_t*>(
+        ngx_pcalloc(pool_, sizeof(ngx_ssl_t)));
+    if (ssl == NULL) {
+      return false;
+    }
+    ssl->log = log_;
+    ngx_uint_t protocols = NGX_SSL_TLSv1 | NGX_SSL_TLSv1_1 | NGX_SSL_TLSv1_2;
+#ifdef NGX_SSL_TLSv1_3
+    protocols |= NGX_SSL_TLSv1_3;
+#endif
+    if (ngx_ssl_create(ssl, protocols, NULL) != NGX_OK) {
+      ngx_log_error(NGX_LOG_ERR, log_, 0,
+          "NgxUrlAsyncFetcher::InitSsl create ssl context failed");
+      return false;
+    }
+
+    int loaded;
+    if (ssl_certificates_dir_.empty() && ssl_certificates_file_.empty()) {
+      loaded = SSL_CTX_set_default_verify_paths(ssl->ctx);
+    } else {
+      loaded = SSL_CTX_load_verify_locations(
+          ssl->ctx,
+          ssl_certificates_file_.empty() ?
+              NULL : ssl_certificates_file_.c_str(),
+          ssl_certificates_dir_.empty() ?
+              NULL : ssl_certificates_dir_.c_str());
+    }
+    if (loaded != 1) {
+      ngx_log_error(NGX_LOG_ERR, log_, 0,
+          "NgxUrlAsyncFetcher::InitSsl loading certificates failed");
+      ngx_ssl_cleanup_ctx(ssl);
+      return false;
+    }
+    ssl_ = ssl;
+    return true;
+  }
+
+  bool NgxUrlAsyncFetcher::SslCertificateOk(ngx_connection_t* c,
+                                            ngx_str_t* host) {
+    long result = SSL_get_verify_result(c->ssl->connection);  // NOLINT
+    switch (result) {
+      case X509_V_OK:
+        break;
+      case X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT:
+      case X509_V_ERR_SELF_SIGNED_CERT_IN_CHAIN:
+        if (!allow_self_signed_) {
+          return false;
+        }
+        break;
+      case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT:
+      case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT_LOCALLY:
+      case X509_V_ERR_UNABLE_TO_VERIFY_LEAF_SIGNATURE:
+        if (!allow_unknown_certificate_authority_) {
+          return false;
+        }
+        break;
+      case X509_V_ERR_CERT_NOT_YET_VALID:
+        if (!allow_certificate_not_yet_valid_) {
+          return false;
+        }
+        break;
+      default:
+        return false;
+    }
+    return ngx_ssl_check_host(c, host) == NGX_OK;
+  }
+
+  ngx_ssl_session_t* NgxUrlAsyncFetcher::SslSession(
+      const GoogleString& origin) {
+    std::map<GoogleString, ngx_ssl_session_t*>::iterator p =
+        ssl_sessions_.find(origin);
+    return p == ssl_sessions_.end() ? NULL : p->second;
+  }
+
+  void NgxUrlAsyncFetcher::SaveSslSession(const GoogleString& origin,
+                                          ngx_connection_t* c) {
+    ngx_ssl_session_t* session = ngx_ssl_get_session(c);
+    if (session == NULL) {
+      return;
+    }
+    std::map<GoogleString, ngx_ssl_session_t*>::iterator p =
+        ssl_sessions_.find(origin);
+    if (p != ssl_sessions_.end()) {
+      ngx_ssl_free_session(p->second);
+      p->second = session;
+      return;
+    }
+    if (ssl_sessions_.size() >= kMaxSslSessions) {
+      // Crude, but origins beyond this many are unlikely to repeat.
+      ngx_ssl_free_session(ssl_sessions_.begin()->second);
+      ssl_sessions_.erase(ssl_sessions_.begin());
+    }
+    ssl_sessions_[origin] = session;
+  }
+#endif
 
   bool NgxUrlAsyncFetcher::ParseUrl(ngx_url_t* url, ngx_pool_t* pool) {
     size_t scheme_offset;
@@ -131,7 +448,8 @@ namespace net_instaweb {
     url->url.len -= scheme_offset;
     url->default_port = port;
     // See: http://lxr.evanmiller.org/http/source/core/ngx_inet.c#L875
-    url->no_resolve = 0;
+    // We resolve asynchronously later, if the host needs it at all.
+    url->no_resolve = 1;
     url->uri_part = 1;
 
     if (ngx_parse_url(pool, url) == NGX_OK) {
@@ -140,6 +458,205 @@ namespace net_instaweb {
     return false;
   }
 
+  ngx_http_upstream_srv_conf_t* NgxUrlAsyncFetcher::FindUpstream(
+      const ngx_url_t& url) {
+    // proxy_pass doesn't take a port with upstream names either.
+    if (upstreams_.empty() || !url.no_port) {
+      return NULL;
+    }
+    GoogleString host(reinterpret_cast<char*>(url.host.data), url.host.len);
+    LowerString(&host);
+    if (upstreams_.find(host) == upstreams_.end()) {
+      return NULL;
+    }
+
+    ngx_http_upstream_main_conf_t* umcf =
+        static_cast<ngx_http_upstream_main_conf_t*>(
+            ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                                ngx_http_upstream_module));
+    if (umcf == NULL) {
+      return NULL;
+    }
+    ngx_http_upstream_srv_conf_t** uscfp =
+        static_cast<ngx_http_upstream_srv_conf_t**>(umcf->upstreams.elts);
+    for (ngx_uint_t i = 0; i < umcf->upstreams.nelts; i++) {
+      // Only explicit upstream{} blocks, not the ones proxy_pass makes up.
+      if ((uscfp[i]->flags & NGX_HTTP_UPSTREAM_CREATE) &&
+          uscfp[i]->host.len == url.host.len &&
+          ngx_strncasecmp(uscfp[i]->host.data, url.host.data,
+                          url.host.len) == 0) {
+        if (!UpstreamIsSupported(uscfp[i])) {
+          // Only complain once; from now on the name is resolved as usual.
+          message_handler_->Message(
+              kError, "NativeFetcherUpstream %s balances on \"hash\", which "
+              "needs a client request; fetching from it via DNS instead.",
+              host.c_str());
+          upstreams_.erase(host);
+          return NULL;
+        }
+        return uscfp[i];
+      }
+    }
+    return NULL;
+  }
+
+  bool NgxUrlAsyncFetcher::UpstreamIsSupported(
+      ngx_http_upstream_srv_conf_t* uscf) {
+    // Round-robin, least_conn, ip_hash, random and keepalive only look at
+    // the peer connection we set up, but "hash" evaluates its key against
+    // the request's variables.  Its module is found by name, as it may not
+    // be built in.  Its server config starts with the key, which is empty
+    // unless the block uses it.  Modules only have names from 1.9.11 on.
+#if (nginx_version >= 1009011)
+    ngx_module_t** modules = ngx_cycle->modules;
+    for (ngx_uint_t i = 0; modules[i] != NULL; i++) {
+      if (modules[i]->type != NGX_HTTP_MODULE ||
+          modules[i]->name == NULL ||
+          ngx_strcmp(modules[i]->name, "ngx_http_upstream_hash_module") != 0) {
+        continue;
+      }
+      ngx_http_complex_value_t* key =
+          static_cast<ngx_http_complex_value_t*>(
+              uscf->srv_conf[modules[i]->ctx_index]);
+      return key == NULL || key->value.len == 0;
+    }
+#endif
+    return true;
+  }
+
+  bool NgxUrlAsyncFetcher::SetLoopbackSocket(StringPiece path) {
+    loopback_socklen_ = 0;
+    if (path.empty()) {
+      return true;
+    }
+#if (NGX_HAVE_UNIX_DOMAIN)
+    ngx_memzero(&loopback_sockaddr_, sizeof(loopback_sockaddr_));
+    if (path.size() >= sizeof(loopback_sockaddr_.sun_path)) {
+      return false;
+    }
+    loopback_sockaddr_.sun_family = AF_UNIX;
+    ngx_memcpy(loopback_sockaddr_.sun_path, path.data(), path.size());
+    loopback_socklen_ = sizeof(loopback_sockaddr_);
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  bool NgxUrlAsyncFetcher::IsLoopback(const struct sockaddr_in& address) const {
+    return FindListening(address) != NULL;
+  }
+
+  bool NgxUrlAsyncFetcher::CanUseLoopbackSocket(
+      const struct sockaddr_in& address, StringPiece host) const {
+    if (loopback_socklen_ == 0) {
+      return false;
+    }
+    // Only http{} listeners have the servers ServerFor() looks at.
+    ngx_listening_t* tcp = FindListening(address);
+    if (tcp == NULL || tcp->handler != ngx_http_init_connection) {
+      return false;
+    }
+#if (NGX_HAVE_UNIX_DOMAIN)
+    ngx_listening_t* ls = static_cast<ngx_listening_t*>(
+        ngx_cycle->listening.elts);
+    for (ngx_uint_t i = 0; i < ngx_cycle->listening.nelts; i++) {
+      if (ls[i].sockaddr->sa_family != AF_UNIX ||
+          ls[i].handler != ngx_http_init_connection ||
+          ngx_strcmp(reinterpret_cast<struct sockaddr_un*>(
+                         ls[i].sockaddr)->sun_path,
+                     loopback_sockaddr_.sun_path) != 0) {
+        continue;
+      }
+      ngx_http_core_srv_conf_t* server =
+          ServerFor(&ls[i], INADDR_ANY, host);
+      return server != NULL &&
+          server == ServerFor(tcp, address.sin_addr.s_addr, host);
+    }
+#endif
+    return false;
+  }
+
+  ngx_http_core_srv_conf_t* NgxUrlAsyncFetcher::ServerFor(
+      ngx_listening_t* ls, in_addr_t addr, StringPiece host) {
+    // As ngx_http_init_connection() and ngx_http_find_virtual_server() pick
+    // them.  Listeners for more than one address list the wildcard last.
+    ngx_http_port_t* port = static_cast<ngx_http_port_t*>(ls->servers);
+    ngx_http_in_addr_t* addrs = static_cast<ngx_http_in_addr_t*>(port->addrs);
+    ngx_http_addr_conf_t* conf = &addrs[port->naddrs - 1].conf;
+    for (ngx_uint_t i = 0; i + 1 < port->naddrs; i++) {
+      if (addrs[i].addr == addr) {
+        conf = &addrs[i].conf;
+        break;
+      }
+    }
+    ngx_http_virtual_names_t* virtual_names = conf->virtual_names;
+    if (virtual_names == NULL || host.empty()) {
+      return conf->default_server;
+    }
+    GoogleString name;
+    host.CopyToString(&name);
+    LowerString(&name);
+    u_char* data = reinterpret_cast<u_char*>(&name[0]);
+    void* server = ngx_hash_find_combined(
+        &virtual_names->names, ngx_hash_key(data, name.size()), data,
+        name.size());
+    if (server != NULL) {
+      return static_cast<ngx_http_core_srv_conf_t*>(server);
+    }
+#if (NGX_PCRE)
+    // We can't tell what a regex server_name would match without a request.
+    if (virtual_names->nregex > 0) {
+      return NULL;
+    }
+#endif
+    return conf->default_server;
+  }
+
+  ngx_listening_t* NgxUrlAsyncFetcher::FindListening(
+      const struct sockaddr_in& address) const {
+    in_addr_t addr = address.sin_addr.s_addr;
+    // Wildcard listeners take anything for their port, but we only know the
+    // loopback addresses to be ours.
+    bool is_loopback_net = (ntohl(addr) >> 24) == 127;
+    ngx_listening_t* ls = static_cast<ngx_listening_t*>(
+        ngx_cycle->listening.elts);
+    for (ngx_uint_t i = 0; i < ngx_cycle->listening.nelts; i++) {
+      if (ls[i].sockaddr->sa_family != AF_INET) {
+        continue;
+      }
+      struct sockaddr_in* sin =
+          reinterpret_cast<struct sockaddr_in*>(ls[i].sockaddr);
+      if (sin->sin_port != address.sin_port) {
+        continue;
+      }
+      if (sin->sin_addr.s_addr == addr ||
+          (sin->sin_addr.s_addr == INADDR_ANY && is_loopback_net)) {
+        return &ls[i];
+      }
+    }
+    return NULL;
+  }
+
+  bool NgxUrlAsyncFetcher::CoalescingKey(const GoogleString& url,
+                                         AsyncFetch* fetch,
+                                         GoogleString* key) {
+    const RequestHeaders* request_headers = fetch->request_headers();
+    if (request_headers->method() != RequestHeaders::kGet ||
+        request_headers->Has(HttpAttributes::kAuthorization) ||
+        request_headers->Has(HttpAttributes::kCookie)) {
+      return false;
+    }
+    // We don't know what the response will vary on yet, so only requests
+    // with the very same headers share a fetch.
+    *key = url;
+    for (int i = 0, n = request_headers->NumAttributes(); i < n; ++i) {
+      StrAppend(key, "\n", request_headers->Name(i), ": ",
+                request_headers->Value(i));
+    }
+    return true;
+  }
+
   // If there are still active requests, cancel them.
   void NgxUrlAsyncFetcher::CancelActiveFetches() {
     // TODO(oschaaf): this seems tricky, this may end up calling
@@ -186,6 +703,19 @@ namespace net_instaweb {
 
   void NgxUrlAsyncFetcher::ShutDown() {
     shutdown_ = true;
+    // Queued fetches never started, so they're not in any pool.
+    std::list<NgxFetch*> queued;
+    {
+      ScopedMutex lock(mutex_);
+      queued.swap(queued_fetches_);
+      queued.splice(queued.end(), queued_background_fetches_);
+      queued_fetches_count_->Add(-static_cast<int64>(queued.size()));
+    }
+    for (std::list<NgxFetch*>::iterator p = queued.begin();
+         p != queued.end(); ++p) {
+      (*p)->CallbackDone(false);
+      delete *p;
+    }
     if (!pending_fetches_.empty()) {
       for (Pool<NgxFetch>::iterator p = pending_fetches_.begin(),
            e = pending_fetches_.end(); p != e; p++) {
@@ -221,10 +751,36 @@ namespace net_instaweb {
       async_fetch->Done(false);
       return;
     }
-    async_fetch = EnableInflation(async_fetch);
-    NgxFetch* fetch = new NgxFetch(url, async_fetch,
-          message_handler, log_);
+    GoogleString key;
+    bool coalesce = CoalescingKey(url, async_fetch, &key);
+    bool background = async_fetch->IsBackgroundFetch();
+    GoogleUrl gurl(url);
+    StringPiece origin(url);
+    if (gurl.IsWebValid()) {
+      origin = gurl.Origin();
+    }
+
     ScopedMutex lock(mutex_);
+    CoalescedFetch* coalesced_fetch = NULL;
+    if (coalesce) {
+      std::map<GoogleString, CoalescedFetch*>::iterator p =
+          coalesced_fetches_.find(key);
+      if (p != coalesced_fetches_.end()) {
+        p->second->AddWaiter(async_fetch);
+        coalesced_fetches_count_->Add(1);
+        return;
+      }
+      coalesced_fetch = new CoalescedFetch(this, key, async_fetch);
+      coalesced_fetches_[key] = coalesced_fetch;
+      async_fetch = coalesced_fetch;
+    }
+    async_fetch = EnableInflation(async_fetch);
+    NgxFetch* fetch = NewFetch(url, async_fetch, message_handler);
+    fetch->set_origin(origin);
+    fetch->set_background(background);
+    if (coalesced_fetch != NULL) {
+      coalesced_fetch->set_fetch(fetch);
+    }
     pending_fetches_.Add(fetch);
 
     // TODO(oschaaf): thread safety on written vs shutdown.
@@ -237,27 +793,75 @@ namespace net_instaweb {
   // This is the read event which is called in the main thread.
   // It will do the real work. Add the work event and start the fetch.
   void NgxUrlAsyncFetcher::ReadCallback(const ps_event_data& data) {
-    std::vector<NgxFetch*> to_start;
     NgxUrlAsyncFetcher* fetcher = reinterpret_cast<NgxUrlAsyncFetcher*>(
       data.sender);
 
     fetcher->mutex_->Lock();
-    fetcher->completed_fetches_.DeleteAll();
+    for (Pool<NgxFetch>::iterator p = fetcher->completed_fetches_.begin(),
+             e = fetcher->completed_fetches_.end(); p != e; p++) {
+      fetcher->RecycleFetch(*p);
+    }
+    fetcher->completed_fetches_.Clear();
 
     for (Pool<NgxFetch>::iterator p = fetcher->pending_fetches_.begin(),
              e = fetcher->pending_fetches_.end(); p != e; p++) {
       NgxFetch* fetch = *p;
-      to_start.push_back(fetch);
+      if (fetch->background()) {
+        fetcher->queued_background_fetches_.push_back(fetch);
+      } else {
+        fetcher->queued_fetches_.push_back(fetch);
+      }
+      fetcher->queued_fetches_count_->Add(1);
     }
 
     fetcher->pending_fetches_.Clear();
     fetcher->mutex_->Unlock();
 
-    for (size_t i = 0; i < to_start.size(); i++) {
-      fetcher->StartFetch(to_start[i]);
+    fetcher->ScheduleFetches();
+    return;
+  }
+
+  void NgxUrlAsyncFetcher::ScheduleFetches() {
+    std::vector<NgxFetch*> to_start;
+    {
+      ScopedMutex lock(mutex_);
+      // Someone may have started waiting on a background fetch since it got
+      // queued.
+      for (std::list<NgxFetch*>::iterator p =
+               queued_background_fetches_.begin();
+           p != queued_background_fetches_.end();) {
+        if (!(*p)->background()) {
+          queued_fetches_.push_back(*p);
+          p = queued_background_fetches_.erase(p);
+        } else {
+          ++p;
+        }
+      }
+
+      std::list<NgxFetch*>* queues[] = {
+        &queued_fetches_, &queued_background_fetches_
+      };
+      for (int i = 0; i < 2; ++i) {
+        std::list<NgxFetch*>* queue = queues[i];
+        for (std::list<NgxFetch*>::iterator p = queue->begin();
+             p != queue->end();) {
+          int* in_flight = &fetches_per_origin_[(*p)->origin()];
+          if (max_fetches_per_origin_ > 0 &&
+              *in_flight >= max_fetches_per_origin_) {
+            ++p;
+            continue;
+          }
+          ++*in_flight;
+          to_start.push_back(*p);
+          p = queue->erase(p);
+        }
+      }
+      queued_fetches_count_->Add(-static_cast<int64>(to_start.size()));
     }
 
-    return;
+    for (size_t i = 0; i < to_start.size(); i++) {
+      StartFetch(to_start[i]);
+    }
   }
 
   // TODO(oschaaf): return value is ignored.
@@ -290,6 +894,132 @@ namespace net_instaweb {
     fetchers_count_--;
     active_fetches_.Remove(fetch);
     completed_fetches_.Add(fetch);
+
+    std::map<GoogleString, int>::iterator p =
+        fetches_per_origin_.find(fetch->origin());
+    if (p != fetches_per_origin_.end() && --p->second <= 0) {
+      fetches_per_origin_.erase(p);
+    }
+    // Let the next fetch for this origin go ahead.  We don't start it from
+    // here, as we're in the middle of finishing this one.
+    if ((!queued_fetches_.empty() || !queued_background_fetches_.empty()) &&
+        !shutdown_) {
+      event_connection_->WriteEvent(this);
+    }
+  }
+
+  void NgxUrlAsyncFetcher::RecordTimings(
+      const GoogleString& origin, const int64 phase_ms[kNumFetchPhases],
+      int64 now_ms) {
+    for (int i = 0; i < kNumFetchPhases; ++i) {
+      // We only resolve names we don't know about yet.
+      if (i != kDnsPhase || phase_ms[i] > 0) {
+        phase_histograms_[i]->Add(phase_ms[i]);
+      }
+    }
+
+    ScopedMutex lock(mutex_);
+    if (origin_timings_start_ms_ == 0) {
+      origin_timings_start_ms_ = now_ms;
+    }
+    std::map<GoogleString, OriginTimings>::iterator p =
+        origin_timings_.find(origin);
+    if (p == origin_timings_.end() &&
+        origin_timings_.size() < kMaxTimedOrigins) {
+      p = origin_timings_.insert(
+          std::make_pair(origin, OriginTimings())).first;
+    }
+    if (p != origin_timings_.end()) {
+      OriginTimings* timings = &p->second;
+      ++timings->fetches;
+      for (int i = 0; i < kNumFetchPhases; ++i) {
+        timings->total_ms[i] += phase_ms[i];
+      }
+    }
+    if (now_ms - origin_timings_start_ms_ >= slow_origins_interval_ms_) {
+      ReportSlowOrigins();
+      origin_timings_.clear();
+      origin_timings_start_ms_ = now_ms;
+    }
+  }
+
+  void NgxUrlAsyncFetcher::ReportSlowOrigins() {
+    // By average time to fetch, slowest first.
+    std::vector<std::pair<int64, GoogleString> > by_average;
+    for (std::map<GoogleString, OriginTimings>::const_iterator p =
+             origin_timings_.begin(); p != origin_timings_.end(); ++p) {
+      int64 total_ms = 0;
+      for (int i = 0; i < kNumFetchPhases; ++i) {
+        total_ms += p->second.total_ms[i];
+      }
+      by_average.push_back(
+          std::make_pair(total_ms / p->second.fetches, p->first));
+    }
+    int n = std::min(kSlowOriginsReported,
+                     static_cast<int>(by_average.size()));
+    std::partial_sort(by_average.begin(), by_average.begin() + n,
+                      by_average.end(),
+                      std::greater<std::pair<int64, GoogleString> >());
+    for (int rank = 0; rank < n; ++rank) {
+      const GoogleString& origin = by_average[rank].second;
+      const OriginTimings& timings = origin_timings_[origin];
+      GoogleString phases;
+      for (int i = 0; i < kNumFetchPhases; ++i) {
+        StrAppend(&phases, i == 0 ? "" : ", ", kPhaseNames[i], " ",
+                  Integer64ToString(timings.total_ms[i] / timings.fetches),
+                  "ms");
+      }
+      message_handler_->Message(
+          kInfo, "Slow origin #%d: %s, %sms on average over %s fetches "
+          "(%s)", rank + 1, origin.c_str(),
+          Integer64ToString(by_average[rank].first).c_str(),
+          Integer64ToString(timings.fetches).c_str(), phases.c_str());
+    }
+  }
+
+  ngx_pool_t* NgxUrlAsyncFetcher::AcquirePool() {
+    if (free_pools_.empty()) {
+      return ngx_create_pool(kFetchPoolSize, log_);
+    }
+    ngx_pool_t* pool = free_pools_.back();
+    free_pools_.pop_back();
+    return pool;
+  }
+
+  void NgxUrlAsyncFetcher::ReleasePool(ngx_pool_t* pool) {
+    // ngx_reset_pool() leaves cleanup handlers in place, pointing into memory
+    // it's about to hand out again.  We don't add any, but be careful.
+    if (free_pools_.size() >= kMaxFreeFetches || pool->cleanup != NULL) {
+      ngx_destroy_pool(pool);
+      return;
+    }
+    ngx_reset_pool(pool);
+    pool->log = log_;
+    free_pools_.push_back(pool);
+  }
+
+  NgxFetch* NgxUrlAsyncFetcher::NewFetch(const GoogleString& url,
+                                         AsyncFetch* async_fetch,
+                                         MessageHandler* message_handler) {
+    void* storage;
+    if (free_fetches_.empty()) {
+      storage = ::operator new(sizeof(NgxFetch));
+    } else {
+      storage = free_fetches_.back();
+      free_fetches_.pop_back();
+    }
+    // The storage is as good as any from operator new, so these can still be
+    // deleted as usual.
+    return new(storage) NgxFetch(url, async_fetch, message_handler, log_);
+  }
+
+  void NgxUrlAsyncFetcher::RecycleFetch(NgxFetch* fetch) {
+    if (free_fetches_.size() >= kMaxFreeFetches) {
+      delete fetch;
+      return;
+    }
+    fetch->~NgxFetch();
+    free_fetches_.push_back(fetch);
   }
 
   void NgxUrlAsyncFetcher::PrintActiveFetches(MessageHandler* handler) const {
@@ -33,8 +33,12 @@
 extern "C" {
   #include <ngx_config.h>
   #include <ngx_core.h>
+  #include <ngx_http.h>
 }
 
+#include <list>
+#include <map>
+#include <set>
 #include <vector>
 
 #include "ngx_event_connection.h"
@@ -43,6 +47,7 @@ extern "C" {
 #include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/pool.h"
 #include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/base/thread_system.h"
 
 
@@ -51,19 +56,33 @@ namespace net_instaweb {
 class AsyncFetch;
 class MessageHandler;
 class Statistics;
+class Histogram;
 class NgxFetch;
+class UpDownCounter;
 class Variable;
 
 class NgxUrlAsyncFetcher : public UrlAsyncFetcher {
  public:
+  // The parts of a fetch we time.  Connecting includes the TLS handshake.
+  enum FetchPhase {
+    kDnsPhase,
+    kConnectPhase,
+    kWriteRequestPhase,
+    kFirstBytePhase,
+    kBodyPhase,
+    kNumFetchPhases
+  };
+
   NgxUrlAsyncFetcher(
       const char* proxy, ngx_log_t* log, ngx_msec_t resolver_timeout,
       ngx_msec_t fetch_timeout, ngx_resolver_t* resolver,
       int max_keepalive_requests, ThreadSystem* thread_system,
-      MessageHandler* handler);
+      Statistics* statistics, MessageHandler* handler);
 
   ~NgxUrlAsyncFetcher();
 
+  static void InitStats(Statistics* statistics);
+
   // It should be called in the module init_process callback function. Do some
   // intializations which can't be done in the master process
   bool Init(ngx_cycle_t* cycle);
@@ -74,7 +93,20 @@ class NgxUrlAsyncFetcher : public UrlAsyncFetcher {
   // the read handler in the main thread
   static void ReadCallback(const ps_event_data& data);
 
-  virtual bool SupportsHttps() const { return false; }
+  virtual bool SupportsHttps() const;
+
+  // Takes the same comma-separated options as the serf fetcher: "enable",
+  // "disable", "allow_self_signed", "allow_unknown_certificate_authority" and
+  // "allow_certificate_not_yet_valid".  Returns false on unknown options.
+  bool SetHttpsOptions(StringPiece options);
+  // Where to find the CA certificates to verify origins with.  When neither
+  // is set the system defaults are used.
+  void SetSslCertificatesDir(StringPiece dir) {
+    dir.CopyToString(&ssl_certificates_dir_);
+  }
+  void SetSslCertificatesFile(StringPiece file) {
+    file.CopyToString(&ssl_certificates_file_);
+  }
 
   virtual void Fetch(const GoogleString& url,
                      MessageHandler* message_handler,
@@ -82,10 +114,39 @@ class NgxUrlAsyncFetcher : public UrlAsyncFetcher {
 
   bool StartFetch(NgxFetch* fetch);
 
+  // How many fetches may be in flight to any one origin; 0 for no limit.
+  // NativeFetcherMaxFetchesPerOrigin, 16 unless configured.
+  // Fetches over the limit wait their turn, with the ones a user is waiting
+  // on going first.
+  void set_max_fetches_per_origin(int x) { max_fetches_per_origin_ = x; }
+
+  // How often RecordTimings() logs the slowest origins.
+  // NativeFetcherSlowOriginsIntervalSec, five minutes unless configured.
+  void set_slow_origins_interval_ms(int64 x) { slow_origins_interval_ms_ = x; }
+
+  // Names of nginx upstream{} blocks to fetch through.  A url whose host is
+  // one of these, with no port, is fetched from the servers the block picks,
+  // so its load balancing, failure accounting and keepalive cache apply.
+  // Hosts without such a block are resolved as usual, and so are blocks that
+  // balance on "hash", which needs a real client request.
+  void set_upstreams(const std::set<GoogleString>& names) {
+    upstreams_ = names;
+  }
+
+  // Fetches for an address this nginx listens on go to it over the unix
+  // domain socket at path instead of TCP, when the server{} that would answer
+  // them also has "listen unix:<path>;".  Returns false if path can't be
+  // used.
+  bool SetLoopbackSocket(StringPiece path);
+
   // Remove the completed fetch from the active fetch set, and put it into a
   // completed fetch list to be cleaned up.
   void FetchComplete(NgxFetch* fetch);
   void PrintActiveFetches(MessageHandler* handler) const;
+  // Accounts for how long each phase of a successful fetch took, and now and
+  // then reports the origins that were slowest to fetch from.
+  void RecordTimings(const GoogleString& origin,
+                     const int64 phase_ms[kNumFetchPhases], int64 now_ms);
 
   // Indicates that it should track the original content length for
   // fetched resources.
@@ -120,14 +181,103 @@ class NgxUrlAsyncFetcher : public UrlAsyncFetcher {
 
 
  private:
+  // Hands what one origin fetch got to every caller that asked for the same
+  // thing while it was starting.
+  class CoalescedFetch;
+
   static void TimeoutHandler(ngx_event_t* tev);
   static bool ParseUrl(ngx_url_t* url, ngx_pool_t* pool);
+  // The upstream{} block to fetch url through, or NULL.  Called in the main
+  // thread.
+  ngx_http_upstream_srv_conf_t* FindUpstream(const ngx_url_t& url);
+  // Whether uscf picks its servers without looking at the client request,
+  // which our fetches only fake.
+  static bool UpstreamIsSupported(ngx_http_upstream_srv_conf_t* uscf);
+  // Whether address is one this nginx accepts connections on.  Called in the
+  // main thread.
+  bool IsLoopback(const struct sockaddr_in& address) const;
+  // Whether a fetch for host from address can go over the loopback socket
+  // instead: only if the server{} that would answer it over TCP also listens
+  // on the socket.  Called in the main thread.
+  bool CanUseLoopbackSocket(const struct sockaddr_in& address,
+                            StringPiece host) const;
+  ngx_listening_t* FindListening(const struct sockaddr_in& address) const;
+  // The server{} a request for host on ls, accepted on addr, goes to, or NULL
+  // if we can't tell.
+  static ngx_http_core_srv_conf_t* ServerFor(ngx_listening_t* ls,
+                                             in_addr_t addr, StringPiece host);
+  // Whether fetch may share its origin fetch with identical requests, and if
+  // so what identifies those.
+  static bool CoalescingKey(const GoogleString& url, AsyncFetch* fetch,
+                            GoogleString* key);
+  // Starts what queued fetches the per-origin limit allows.  Called in the
+  // main thread.
+  void ScheduleFetches();
+  // Must be called with mutex_ held.
+  void ReportSlowOrigins();
+
+  // Fetches and their pools are recycled rather than freed.  A recycled
+  // NgxFetch is destructed, and its storage constructed into again; pools
+  // are reset.  AcquirePool() and ReleasePool() are only called in the main
+  // thread.
+  ngx_pool_t* AcquirePool();
+  void ReleasePool(ngx_pool_t* pool);
+  // Must be called with mutex_ held.
+  NgxFetch* NewFetch(const GoogleString& url, AsyncFetch* async_fetch,
+                     MessageHandler* message_handler);
+  void RecycleFetch(NgxFetch* fetch);
+
+  struct OriginTimings {
+    OriginTimings() : fetches(0) {
+      for (int i = 0; i < kNumFetchPhases; ++i) {
+        total_ms[i] = 0;
+      }
+    }
+    int64 fetches;
+    int64 total_ms[kNumFetchPhases];
+  };
   friend class NgxFetch;
 
+#if (NGX_SSL)
+  // Creates the TLS context on the first https fetch.  Called in the main
+  // thread.
+  bool InitSsl();
+  // Whether the origin's certificate on c is acceptable to us.
+  bool SslCertificateOk(ngx_connection_t* c, ngx_str_t* host);
+  // Session resumption state per origin ("host:port").  Only touched in the
+  // main thread.  The returned session is still owned by the fetcher.
+  ngx_ssl_session_t* SslSession(const GoogleString& origin);
+  void SaveSslSession(const GoogleString& origin, ngx_connection_t* c);
+#endif
+
   NgxFetchPool active_fetches_;
   // Add the pending task to this list
   NgxFetchPool pending_fetches_;
   NgxFetchPool completed_fetches_;
+  // Origin fetches that haven't received headers yet, by CoalescingKey().
+  // Protected by mutex_.
+  std::map<GoogleString, CoalescedFetch*> coalesced_fetches_;
+  // Fetches waiting for their origin to have room, user-facing ones and
+  // background ones, and how many are in flight per origin.  Protected by
+  // mutex_.
+  std::list<NgxFetch*> queued_fetches_;
+  std::list<NgxFetch*> queued_background_fetches_;
+  std::map<GoogleString, int> fetches_per_origin_;
+  int max_fetches_per_origin_;
+  std::set<GoogleString> upstreams_;
+#if (NGX_HAVE_UNIX_DOMAIN)
+  struct sockaddr_un loopback_sockaddr_;
+#endif
+  // 0 unless we have a loopback socket.
+  socklen_t loopback_socklen_;
+  // Storage for NgxFetch objects, protected by mutex_, and pools for them to
+  // use, which only the main thread touches.
+  std::vector<void*> free_fetches_;
+  std::vector<ngx_pool_t*> free_pools_;
+  // Timings by origin since we last reported.  Protected by mutex_.
+  std::map<GoogleString, OriginTimings> origin_timings_;
+  int64 origin_timings_start_ms_;
+  int64 slow_origins_interval_ms_;
   ngx_url_t proxy_;
 
   int fetchers_count_;
@@ -149,6 +299,25 @@ class NgxUrlAsyncFetcher : public UrlAsyncFetcher {
 
   NgxEventConnection* event_connection_;
 
+  bool https_enabled_;
+  bool allow_self_signed_;
+  bool allow_unknown_certificate_authority_;
+  bool allow_certificate_not_yet_valid_;
+  GoogleString ssl_certificates_dir_;
+  GoogleString ssl_certificates_file_;
+#if (NGX_SSL)
+  ngx_ssl_t* ssl_;
+  std::map<GoogleString, ngx_ssl_session_t*> ssl_sessions_;
+#endif
+  Variable* ssl_handshakes_;
+  Variable* ssl_session_reuses_;
+  Variable* coalesced_fetches_count_;
+  UpDownCounter* queued_fetches_count_;
+  Variable* upstream_fetches_;
+  Variable* loopback_fetches_;
+  Variable* remote_fetches_;
+  Histogram* phase_histograms_[kNumFetchPhases];
+
   DISALLOW_COPY_AND_ASSIGN(NgxUrlAsyncFetcher);
 };
 
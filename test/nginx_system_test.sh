@@ -36,6 +36,9 @@
 : ${NGINX_EXECUTABLE:?"Set NGINX_EXECUTABLE"}
 : ${PAGESPEED_TEST_HOST:?"Set PAGESPEED_TEST_HOST"}
 POSITION_AUX="${POSITION_AUX:-unset}"
+TLS_PORT="${TLS_PORT:-8054}"
+ORIGIN_PORT="${ORIGIN_PORT:-8055}"
+DNS_PORT="${DNS_PORT:-8056}"
 RUN_CONTROLLER_TEST="${RUN_CONTROLLER_TEST:-off}"
 
 PRIMARY_HOSTNAME="localhost:$PRIMARY_PORT"
@@ -188,7 +191,54 @@ else
 fi
 
 if [ "$NATIVE_FETCHER" = "on" ]; then
-  RESOLVER="resolver 8.8.8.8;"
+  # The native fetcher resolves through a stub that gives
+  # multi-address.pagespeed.test two addresses, and forwards everything else
+  # to a public resolver.
+  cat > "$TEST_TMP/dns_stub.py" <<EOF
+import os, socket, struct, sys, threading, time
+NAMES = {b"multi-address.pagespeed.test": ["127.0.0.2", "127.0.0.1"]}
+UPSTREAM = ("8.8.8.8", 53)
+sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+sock.bind(("127.0.0.1", int(sys.argv[1])))
+def answer(query, client):
+  # The question follows the 12 byte header: length-prefixed labels, a zero
+  # byte, and then the type and class.
+  labels, i = [], 12
+  while query[i]:
+    labels.append(query[i + 1:i + 1 + query[i]])
+    i += 1 + query[i]
+  name = b".".join(labels).lower()
+  if name not in NAMES:
+    forward = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    forward.settimeout(5)
+    try:
+      forward.sendto(query, UPSTREAM)
+      sock.sendto(forward.recv(4096), client)
+    except socket.timeout:
+      pass
+    forward.close()
+    return
+  qtype = struct.unpack("!H", query[i + 1:i + 3])[0]
+  addresses = NAMES[name] if qtype == 1 else []
+  reply = query[:2] + struct.pack("!HHHHH", 0x8180, 1, len(addresses), 0, 0)
+  reply += query[12:i + 5]
+  for address in addresses:
+    reply += struct.pack("!HHHIH", 0xc00c, 1, 1, 300, 4)
+    reply += socket.inet_aton(address)
+  sock.sendto(reply, client)
+# Goes away with the test, however that ends.
+def exit_with_parent(parent):
+  while os.getppid() == parent:
+    time.sleep(1)
+  os._exit(0)
+threading.Thread(target=exit_with_parent, args=(os.getppid(),),
+                 daemon=True).start()
+while True:
+  query, client = sock.recvfrom(4096)
+  threading.Thread(target=answer, args=(query, client), daemon=True).start()
+EOF
+  python3 "$TEST_TMP/dns_stub.py" $DNS_PORT &
+  RESOLVER="resolver 127.0.0.1:$DNS_PORT;"
 else
   RESOLVER=""
 fi
@@ -227,6 +277,8 @@ cat $PAGESPEED_CONF_TEMPLATE \
   | sed 's#@@NATIVE_FETCHER@@#'"$NATIVE_FETCHER"'#' \
   | sed 's#@@RESOLVER@@#'"$RESOLVER"'#' \
   | sed 's#@@RCPORT@@#'"$RCPORT"'#' \
+  | sed 's#@@TLS_PORT@@#'"$TLS_PORT"'#' \
+  | sed 's#@@ORIGIN_PORT@@#'"$ORIGIN_PORT"'#' \
   | sed 's#@@PAGESPEED_TEST_HOST@@#'"$PAGESPEED_TEST_HOST"'#' \
   >> $PAGESPEED_CONF
 # make sure we substituted all the variables
@@ -1276,12 +1328,580 @@ OUT=$($WGET_DUMP -S $HEADERS $URL 2>&1)
 check_not_from "$OUT" fgrep "http://cdn1.example.com"
 check_not_from "$OUT" fgrep "http://cdn2.example.com"
 
+start_test Rewritten html is served from the html output cache.
+URL=http://html-output-cache.example.com/mod_pagespeed_example/
+URL+=collapse_whitespace.html
+# Output is only stored once two misses in a row produced the same bytes, so
+# the third fetch is the first one served from the cache.
+http_proxy=$SECONDARY_HOSTNAME check $WGET_DUMP $URL > /dev/null
+INSERTS=$(scrape_stat html_output_cache_inserts)
+http_proxy=$SECONDARY_HOSTNAME check $WGET_DUMP $URL > /dev/null
+check [ $(scrape_stat html_output_cache_inserts) -eq $((INSERTS + 1)) ]
+HITS=$(scrape_stat html_output_cache_hits)
+OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL)
+check_from "$OUT" fgrep -qi '<html'
+check [ $(scrape_stat html_output_cache_hits) -eq $((HITS + 1)) ]
+
+# Cookies make the request ineligible.
+HITS=$(scrape_stat html_output_cache_hits)
+OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP --header=Cookie:a=b $URL)
+check_from "$OUT" fgrep -qi '<html'
+check [ $(scrape_stat html_output_cache_hits) -eq $HITS ]
+
+# Nor is output with beacons in it ever stored.
+URL=http://html-output-cache-beacons.example.com/mod_pagespeed_example/
+URL+=collapse_whitespace.html
+INSERTS=$(scrape_stat html_output_cache_inserts)
+for i in 1 2 3; do
+  http_proxy=$SECONDARY_HOSTNAME check $WGET_DUMP $URL > /dev/null
+done
+check [ $(scrape_stat html_output_cache_inserts) -eq $INSERTS ]
+
+start_test Html above HtmlRewriteMaxContentLength is not rewritten.
+URL=http://html-max-content-length.example.com/mod_pagespeed_example/
+URL+=rewrite_images.html
+BYPASSES=$(scrape_stat html_rewrite_content_length_bypasses)
+OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL)
+check_not_from "$OUT" fgrep -qi 'addInstrumentationInit'
+check [ $(scrape_stat html_rewrite_content_length_bypasses) \
+  -eq $((BYPASSES + 1)) ]
+
+start_test Html that misses HtmlRewriteDeadlineMs is served as it was.
+URL=http://html-rewrite-deadline.example.com/mod_pagespeed_example/
+URL+=rewrite_images.html?deadline
+HITS=$(scrape_stat html_rewrite_deadline_hits)
+OUT=$(http_proxy=$SECONDARY_HOSTNAME $CURL -sS $URL)
+check [ "$OUT" = \
+  "$(cat "$SERVER_ROOT/mod_pagespeed_example/rewrite_images.html")" ]
+check [ $(scrape_stat html_rewrite_deadline_hits) -gt $HITS ]
+
+start_test Link preload headers for resources seen on the last rewrite.
+URL=http://preload-hints.example.com/mod_pagespeed_example/combine_css.html
+# The first fetch records the stylesheets, the second one gets hints for them.
+http_proxy=$SECONDARY_HOSTNAME check $WGET_DUMP $URL > /dev/null
+OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL)
+check_from "$OUT" egrep -q \
+  '^Link: .*/styles/yellow.css>; rel=preload; as=style'
+
+start_test 103 Early Hints for resources seen on the last rewrite.
+URL=http://early-hints.example.com/mod_pagespeed_example/combine_css.html
+# The first fetch records the stylesheets, the second one is preceded by a 103
+# for them.
+http_proxy=$SECONDARY_HOSTNAME check $WGET_DUMP $URL > /dev/null
+OUT=$(http_proxy=$SECONDARY_HOSTNAME $CURL -sS -D- -o/dev/null $URL)
+check_from "$OUT" egrep -q '^HTTP/1.1 103'
+check_from "$OUT" egrep -q \
+  '^Link: .*/styles/yellow.css>; rel=preload; as=style'
+check_from "$OUT" egrep -q '^HTTP/1.1 200'
+
+start_test Hot .pagespeed. resources are served from the resource hot cache.
+URL=http://resource-hot-cache.example.com/mod_pagespeed_example/styles/
+URL+=big.css.pagespeed.ce.8CfGBvwDhH.css
+# The first fetch fills the cache, the second one is served from it.
+http_proxy=$SECONDARY_HOSTNAME check $WGET_DUMP $URL > /dev/null
+HITS=$(scrape_stat resource_hot_cache_hits)
+OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL)
+check_from "$OUT" fgrep -q 'Cache-Control: max-age=31536000'
+check [ $(scrape_stat resource_hot_cache_hits) -eq $((HITS + 1)) ]
+
+start_test Revalidations of .pagespeed. resources get a 304 without PageSpeed.
+URL=http://resource-not-modified.example.com/mod_pagespeed_example/styles/
+URL+=big.css.pagespeed.ce.8CfGBvwDhH.css
+http_proxy=$SECONDARY_HOSTNAME check $WGET_DUMP $URL > /dev/null
+RESPONSES=$(scrape_stat resource_not_modified_responses)
+OUT=$(curl -sS -D- -o /dev/null --proxy $SECONDARY_HOSTNAME \
+  -H 'If-None-Match: W/"0"' $URL)
+check_from "$OUT" egrep -q '^HTTP/1.1 304'
+check [ $(scrape_stat resource_not_modified_responses) \
+  -eq $((RESPONSES + 1)) ]
+
+start_test .pagespeed. resources are served from files with sendfile.
+URL=http://sendfile-resources.example.com/mod_pagespeed_example/styles/
+URL+=big.css.pagespeed.ce.8CfGBvwDhH.css
+# The first fetch writes the file, the second one is served from it.
+FIRST=$(http_proxy=$SECONDARY_HOSTNAME $WGET -q -O - $URL)
+HITS=$(scrape_stat resource_sendfile_hits)
+SECOND=$(http_proxy=$SECONDARY_HOSTNAME $WGET -q -O - $URL)
+check [ "$FIRST" = "$SECOND" ]
+check [ $(scrape_stat resource_sendfile_hits) -eq $((HITS + 1)) ]
+
+start_test Range requests for .pagespeed. resources get partial responses.
+URL=http://resource-hot-cache.example.com/mod_pagespeed_example/styles/
+URL+=big.css.pagespeed.ce.8CfGBvwDhH.css
+OUT=$(curl -sS -D- -o /dev/null --proxy $SECONDARY_HOSTNAME -r 0-9 $URL)
+check_from "$OUT" egrep -q '^HTTP/1.1 206'
+check_from "$OUT" egrep -qi '^Content-Range: bytes 0-9/'
+check_from "$OUT" egrep -qi '^Content-Length: 10'
+
 if [ "$NATIVE_FETCHER" != "on" ]; then
   start_test Test that we can rewrite an HTTPS resource.
   fetch_until $TEST_ROOT/https_fetch/https_fetch.html \
    'grep -c /https_gstatic_dot_com/1.gif.pagespeed.ce' 1
 fi
 
+if [ "$NATIVE_FETCHER" = "on" ]; then
+  start_test Native fetcher fetches over TLS and resumes sessions.
+  TLS_ROOT="$TEST_TMP/tls-origin"
+  mkdir -p "$TLS_ROOT"
+  openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=127.0.0.1 \
+    -keyout "$TLS_ROOT/key.pem" -out "$TLS_ROOT/cert.pem" 2> /dev/null
+  echo ".tls-one { color: red; }" > "$TLS_ROOT/one.css"
+  echo ".tls-two { color: blue; }" > "$TLS_ROOT/two.css"
+  (cd "$TLS_ROOT" && exec openssl s_server -quiet -WWW -accept $TLS_PORT \
+     -cert cert.pem -key key.pem) & TLS_PID=$!
+  sleep 1
+  # s_server closes every connection, so the second fetch needs a new one.
+  REUSES=$(scrape_stat native_fetcher_ssl_session_reuses)
+  URL=http://tls-origin.example.com/tls/one.css.pagespeed.ce.0.css
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL)
+  check_from "$OUT" fgrep -q ".tls-one"
+  URL=http://tls-origin.example.com/tls/two.css.pagespeed.ce.0.css
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL)
+  check_from "$OUT" fgrep -q ".tls-two"
+  check [ $(scrape_stat native_fetcher_ssl_handshakes) -ge 1 ]
+  check [ $(scrape_stat native_fetcher_ssl_session_reuses) -gt $REUSES ]
+
+  # Certificates that fail verification are rejected after the handshake, so
+  # those handshakes aren't counted.  Each test fetches a file nothing else
+  # did, so nothing comes from the cache.
+  start_test Native fetcher rejects certificates that fail verification.
+  echo ".tls-three { color: green; }" > "$TLS_ROOT/three.css"
+  HANDSHAKES=$(scrape_stat native_fetcher_ssl_handshakes)
+  URL=http://tls-untrusted.example.com/tls/three.css.pagespeed.ce.0.css
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL 2>&1 || true)
+  check_not_from "$OUT" fgrep -q ".tls-three"
+  check [ $(scrape_stat native_fetcher_ssl_handshakes) -eq $HANDSHAKES ]
+  kill $TLS_PID
+
+  start_test Native fetcher rejects certificates for other host names.
+  # Self-signed, which tls-origin.example.com accepts, but not for 127.0.0.1.
+  openssl req -x509 -newkey rsa:2048 -nodes -days 1 \
+    -subj /CN=wrong.example.com -keyout "$TLS_ROOT/wrong-key.pem" \
+    -out "$TLS_ROOT/wrong-cert.pem" 2> /dev/null
+  echo ".tls-four { color: yellow; }" > "$TLS_ROOT/four.css"
+  (cd "$TLS_ROOT" && exec openssl s_server -quiet -WWW -accept $TLS_PORT \
+     -cert wrong-cert.pem -key wrong-key.pem) & TLS_PID=$!
+  sleep 1
+  HANDSHAKES=$(scrape_stat native_fetcher_ssl_handshakes)
+  URL=http://tls-origin.example.com/tls/four.css.pagespeed.ce.0.css
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL 2>&1 || true)
+  check_not_from "$OUT" fgrep -q ".tls-four"
+  check [ $(scrape_stat native_fetcher_ssl_handshakes) -eq $HANDSHAKES ]
+  kill $TLS_PID
+
+  start_test Native fetcher fails cleanly when the only address fails TLS.
+  URL=http://tls-handshake-fail.example.com/tls/mod_pagespeed_example/styles/
+  URL+=yellow.css.pagespeed.ce.0.css
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL 2>&1 || true)
+  check_not_from "$OUT" fgrep -q "yellow"
+  # The worker that failed the fetch is still there to answer.
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP \
+        http://tls-origin.example.com/mod_pagespeed_example/styles/yellow.css)
+  check_from "$OUT" fgrep -q "yellow"
+
+  start_test Native fetcher decodes chunked bodies after interim responses.
+  cat > "$TEST_TMP/chunked_origin.py" <<EOF
+import socket, sys, time
+# Answers every request with a 103, and then a chunked body written a few
+# bytes at a time, so chunk sizes and data straddle the fetcher's reads.
+listener = socket.socket()
+listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+listener.bind(("127.0.0.1", int(sys.argv[1])))
+listener.listen(8)
+chunks = [b".chunked-one { ", b"color: red; }\\n",
+          b".chunked-two { color: blue; }\\n"]
+body = b"".join(b"%x\\r\\n%s\\r\\n" % (len(c), c) for c in chunks)
+body += b"0\\r\\n\\r\\n"
+while True:
+  conn, _ = listener.accept()
+  conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+  conn.recv(65536)
+  conn.sendall(b"HTTP/1.1 103 Early Hints\\r\\n"
+               b"Link: </early.css>; rel=preload\\r\\n\\r\\n")
+  time.sleep(0.05)
+  conn.sendall(b"HTTP/1.1 200 OK\\r\\nContent-Type: text/css\\r\\n"
+               b"Cache-Control: max-age=300\\r\\n"
+               b"Transfer-Encoding: chunked\\r\\n"
+               b"Connection: close\\r\\n\\r\\n")
+  for i in range(0, len(body), 7):
+    conn.sendall(body[i:i + 7])
+    time.sleep(0.02)
+  conn.close()
+EOF
+  python3 "$TEST_TMP/chunked_origin.py" $ORIGIN_PORT & ORIGIN_PID=$!
+  sleep 1
+  REMOTE=$(scrape_stat native_fetcher_remote_fetches)
+  URL=http://chunked-origin.example.com/chunked/style.css.pagespeed.ce.0.css
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL)
+  check_from "$OUT" fgrep -q ".chunked-one { color: red; }"
+  check_from "$OUT" fgrep -q ".chunked-two { color: blue; }"
+  check_not_from "$OUT" fgrep -q "HTTP/1.1 200"
+  check_not_from "$OUT" fgrep -q "early.css"
+  check [ $(scrape_stat native_fetcher_remote_fetches) -gt $REMOTE ]
+  kill $ORIGIN_PID
+
+  start_test Native fetcher merges concurrent identical fetches.
+  cat > "$TEST_TMP/slow_origin.py" <<EOF
+import socketserver, sys, time
+from http.server import BaseHTTPRequestHandler, HTTPServer
+# Answers after a second, so fetches started together overlap, and logs the
+# path of every request it gets.  Keeps connections alive.
+class Handler(BaseHTTPRequestHandler):
+  protocol_version = "HTTP/1.1"
+  def do_GET(self):
+    with open(sys.argv[2], "a") as log:
+      log.write(self.path + "\\n")
+    time.sleep(1)
+    body = b".slow { color: green; }\\n"
+    self.send_response(200)
+    self.send_header("Content-Type", "text/css")
+    self.send_header("Cache-Control", "no-cache")
+    self.send_header("Content-Length", str(len(body)))
+    self.end_headers()
+    self.wfile.write(body)
+  def log_message(self, *args):
+    pass
+class Server(socketserver.ThreadingMixIn, HTTPServer):
+  allow_reuse_address = True
+  daemon_threads = True
+Server(("127.0.0.1", int(sys.argv[1])), Handler).serve_forever()
+EOF
+  ORIGIN_LOG="$TEST_TMP/slow_origin.log"
+  python3 "$TEST_TMP/slow_origin.py" $ORIGIN_PORT "$ORIGIN_LOG" &
+  ORIGIN_PID=$!
+  sleep 1
+  # Fetches /slow/$1 three times at once, passing the rest of the arguments
+  # to curl, and checks all three got the origin's css.
+  function fetch_slow_concurrently() {
+    local url="http://coalesce.example.com/slow/$1"
+    shift
+    local pids=""
+    for i in 1 2 3; do
+      http_proxy=$SECONDARY_HOSTNAME $CURL -sS "$@" \
+        -o "$TEST_TMP/slow.$i" "$url" &
+      pids+=" $!"
+    done
+    wait $pids
+    for i in 1 2 3; do
+      check fgrep -q ".slow { color: green; }" "$TEST_TMP/slow.$i"
+    done
+  }
+  COALESCED=$(scrape_stat native_fetcher_coalesced_fetches)
+  fetch_slow_concurrently merged.css
+  check [ $(scrape_stat native_fetcher_coalesced_fetches) -gt $COALESCED ]
+  check [ $(grep -c "^/merged.css$" "$ORIGIN_LOG") -lt 3 ]
+
+  start_test Native fetcher keeps fetches with credentials apart.
+  COALESCED=$(scrape_stat native_fetcher_coalesced_fetches)
+  EVICTIONS=$(scrape_stat native_fetcher_idle_evictions)
+  fetch_slow_concurrently cookie.css -H "Cookie: session=1"
+  fetch_slow_concurrently authorization.css -H "Authorization: Basic dTpw"
+  check [ $(scrape_stat native_fetcher_coalesced_fetches) -eq $COALESCED ]
+  # Three connections to one origin went idle together, and the test config
+  # only keeps one of them.
+  check [ $(scrape_stat native_fetcher_idle_evictions) -gt $EVICTIONS ]
+  check [ $(grep -c "^/cookie.css$" "$ORIGIN_LOG") -eq 3 ]
+  check [ $(grep -c "^/authorization.css$" "$ORIGIN_LOG") -eq 3 ]
+
+  # NativeFetcherMaxFetchesPerOrigin is left at its default of 16: lower
+  # limits would stall this server's fetches from itself that other tests
+  # make while serving a fetch from itself.
+  start_test Native fetcher queues fetches past the per origin limit.
+  PIDS=""
+  for i in $(seq 1 20); do
+    http_proxy=$SECONDARY_HOSTNAME $CURL -sS \
+      -o "$TEST_TMP/queued.$i" "http://coalesce.example.com/slow/queued$i.css" &
+    PIDS+=" $!"
+  done
+  # The origin takes a second, so the ones over the limit are still waiting.
+  sleep 0.5
+  check [ $(scrape_stat native_fetcher_queued_fetches) -ge 1 ]
+  wait $PIDS
+  for i in $(seq 1 20); do
+    check fgrep -q ".slow { color: green; }" "$TEST_TMP/queued.$i"
+  done
+
+  start_test Native fetcher times the phases of its fetches.
+  URL=http://coalesce.example.com/slow/timed.css
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $CURL -sS $URL)
+  check_from "$OUT" fgrep -q ".slow { color: green; }"
+  # The origin waits a second before it answers, so the histogram has seen
+  # a fetch of at least that long.
+  OUT=$($WGET_DUMP "$HOSTNAME/pagespeed_admin/histograms")
+  check_from "$OUT" fgrep -q native_fetcher_first_byte_ms
+  ROW=$(echo "$OUT" | grep native_fetcher_first_byte_ms | sed 's/<[^>]*>/ /g')
+  check [ $(echo "$ROW" | grep -oE "[0-9]+(\.[0-9]+)?" | \
+            awk '$1 >= 1000 && $1 < 2000' | wc -l) -ge 1 ]
+  # The test config reports slow origins every second, on the first fetch to
+  # finish after that.
+  sleep 1.1
+  URL=http://coalesce.example.com/slow/timed-again.css
+  http_proxy=$SECONDARY_HOSTNAME check $CURL -sS -o /dev/null $URL
+  OUT=$($WGET_DUMP "$HOSTNAME/ngx_pagespeed_message")
+  check_from "$OUT" egrep -q \
+    "Slow origin #1: http://127.0.0.1:$ORIGIN_PORT, 1[0-9]{3}ms on average"
+  check_from "$OUT" egrep -q "first byte 1[0-9]{3}ms"
+  kill $ORIGIN_PID
+
+  start_test Native fetcher resends on a new connection when a pooled one closes.
+  cat > "$TEST_TMP/closing_origin.py" <<EOF
+import sys
+from http.server import BaseHTTPRequestHandler, HTTPServer
+# Answers the first request on each connection and keeps it alive, but closes
+# it without answering the next one, as if it timed the connection out just
+# as the request arrived.  Logs the path of every request it gets.
+class Handler(BaseHTTPRequestHandler):
+  protocol_version = "HTTP/1.1"
+  def do_GET(self):
+    with open(sys.argv[2], "a") as log:
+      log.write(self.path + "\\n")
+    if getattr(self, "answered", False):
+      self.close_connection = True
+      return
+    self.answered = True
+    body = b".closing { color: green; }\\n"
+    self.send_response(200)
+    self.send_header("Content-Type", "text/css")
+    self.send_header("Cache-Control", "no-cache")
+    self.send_header("Content-Length", str(len(body)))
+    self.end_headers()
+    self.wfile.write(body)
+  def log_message(self, format, *args):
+    pass
+HTTPServer(("127.0.0.1", int(sys.argv[1])), Handler).serve_forever()
+EOF
+  ORIGIN_LOG="$TEST_TMP/closing_origin.log"
+  python3 "$TEST_TMP/closing_origin.py" $ORIGIN_PORT "$ORIGIN_LOG" &
+  ORIGIN_PID=$!
+  sleep 1
+  REUSES=$(scrape_stat native_fetcher_connection_reuses)
+  FAILOVERS=$(scrape_stat native_fetcher_address_failovers)
+  for css in pooled-one pooled-two; do
+    OUT=$(http_proxy=$SECONDARY_HOSTNAME $CURL -sS \
+          http://coalesce.example.com/slow/$css.css)
+    check_from "$OUT" fgrep -q ".closing { color: green; }"
+  done
+  # The second fetch went out on the pooled connection first, and the origin
+  # only answered it on the new one.
+  check [ $(scrape_stat native_fetcher_connection_reuses) -gt $REUSES ]
+  check [ $(grep -c "^/pooled-two.css$" "$ORIGIN_LOG") -eq 2 ]
+  # It's the same address, and it's not marked down.
+  check [ $(scrape_stat native_fetcher_address_failovers) -eq $FAILOVERS ]
+  kill $ORIGIN_PID
+
+  start_test Native fetcher remembers names that failed to resolve.
+  HITS=$(scrape_stat native_fetcher_dns_cache_hits)
+  RESOLUTIONS=$(scrape_stat native_fetcher_dns_resolutions)
+  for css in one two; do
+    URL=http://dns-negative.example.com/dns/$css.css.pagespeed.ce.0.css
+    http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL > /dev/null || true
+  done
+  check [ $(scrape_stat native_fetcher_dns_resolutions) -eq \
+          $((RESOLUTIONS + 1)) ]
+  check [ $(scrape_stat native_fetcher_dns_cache_hits) -ge $((HITS + 1)) ]
+
+  start_test Native fetcher fails over to the next address of a name.
+  FAILOVER_ROOT="$TEST_TMP/failover-origin"
+  mkdir -p "$FAILOVER_ROOT"
+  for css in one two three four; do
+    echo ".failover-$css { color: green; }" > "$FAILOVER_ROOT/$css.css"
+  done
+  # Only on 127.0.0.1, so 127.0.0.2 refuses connections.
+  python3 -m http.server --bind 127.0.0.1 --directory "$FAILOVER_ROOT" \
+    $ORIGIN_PORT > /dev/null 2>&1 & ORIGIN_PID=$!
+  sleep 1
+  FAILOVERS=$(scrape_stat native_fetcher_address_failovers)
+  # nginx rotates the addresses it resolves, so either fetch may be the one
+  # that starts on 127.0.0.2.  The other starts on the next address.
+  for css in one two; do
+    URL=http://address-failover.example.com/failover/$css.css
+    OUT=$(http_proxy=$SECONDARY_HOSTNAME $CURL -sS $URL)
+    check_from "$OUT" fgrep -q ".failover-$css { color: green; }"
+  done
+  check [ $(scrape_stat native_fetcher_address_failovers) -eq \
+          $((FAILOVERS + 1)) ]
+  # 127.0.0.2 is marked down for 30 seconds, so these start on 127.0.0.1.
+  for css in three four; do
+    URL=http://address-failover.example.com/failover/$css.css
+    OUT=$(http_proxy=$SECONDARY_HOSTNAME $CURL -sS $URL)
+    check_from "$OUT" fgrep -q ".failover-$css { color: green; }"
+  done
+  check [ $(scrape_stat native_fetcher_address_failovers) -eq \
+          $((FAILOVERS + 1)) ]
+  kill $ORIGIN_PID
+
+  start_test Native fetcher fetches through nginx upstream blocks.
+  FETCHES=$(scrape_stat native_fetcher_upstream_fetches)
+  LOOPBACK=$(scrape_stat native_fetcher_loopback_fetches)
+  URL=http://upstream-fetch.example.com/ups/styles/yellow.css.pagespeed.ce.0.css
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL)
+  check_from "$OUT" fgrep -q "yellow"
+  check [ $(scrape_stat native_fetcher_upstream_fetches) -gt $FETCHES ]
+  # The block's server is this nginx.
+  check [ $(scrape_stat native_fetcher_loopback_fetches) -gt $LOOPBACK ]
+
+  start_test Native fetcher delivers bodies larger than its receive buffer.
+  # The receive buffer grows to 256K at most, so this takes several reads
+  # into a full buffer.
+  LARGE="$SERVER_ROOT/mod_pagespeed_example/native-large.bin"
+  head -c 700000 /dev/urandom > "$LARGE"
+  FETCHES=$(scrape_stat native_fetcher_upstream_fetches)
+  URL=http://upstream-fetch.example.com/ups/native-large.bin
+  http_proxy=$SECONDARY_HOSTNAME check $CURL -sS \
+    -o "$TEST_TMP/native-large.bin" $URL
+  check cmp "$LARGE" "$TEST_TMP/native-large.bin"
+  check [ $(scrape_stat native_fetcher_upstream_fetches) -gt $FETCHES ]
+
+  start_test Native fetcher skips upstream blocks that balance on hash.
+  FETCHES=$(scrape_stat native_fetcher_upstream_fetches)
+  URL=http://upstream-hash-fetch.example.com/ups/styles/yellow.css.pagespeed.ce.0.css
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL)
+  check_not_from "$OUT" fgrep -q "yellow"
+  check [ $(scrape_stat native_fetcher_upstream_fetches) -eq $FETCHES ]
+  # The worker is still around to answer.
+  URL=http://upstream-fetch.example.com/ups/styles/yellow.css.pagespeed.ce.0.css
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL)
+  check_from "$OUT" fgrep -q "yellow"
+
+  start_test Native fetcher fetches from this server over the loopback socket.
+  LOOPBACK=$(scrape_stat native_fetcher_loopback_fetches)
+  REMOTE=$(scrape_stat native_fetcher_remote_fetches)
+  URL=http://loopback-fetch.example.com/mod_pagespeed_example/styles/yellow.css.pagespeed.ce.0.css
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL)
+  check_from "$OUT" fgrep -q "yellow"
+  check [ $(scrape_stat native_fetcher_loopback_fetches) -gt $LOOPBACK ]
+  check [ $(scrape_stat native_fetcher_remote_fetches) -eq $REMOTE ]
+  # The origin fetch came in over the socket, not TCP.
+  check grep -q "^unix: GET /mod_pagespeed_example/styles/yellow.css HTTP/1.1 (200)" \
+    "$TEST_TMP/loopback-fetch.access.log"
+fi
+
+start_test A HEAD for an uncached url stays out of the IPRO negative index.
+INSERTS=$(scrape_stat ipro_negative_index_inserts)
+HITS=$(scrape_stat ipro_negative_index_hits)
+URL="$EXAMPLE_ROOT/images/Puzzle.jpg?ipro-negative-index-head"
+check $CURL -sS -I -o /dev/null "$URL"
+check [ $(scrape_stat ipro_negative_index_inserts) -eq $INSERTS ]
+# So the GET that follows still goes through IPRO.
+check $WGET_DUMP "$URL" > /dev/null
+check [ $(scrape_stat ipro_negative_index_hits) -eq $HITS ]
+
+start_test Only one request at a time records a url for IPRO.
+cat > "$TEST_TMP/stalling_origin.py" <<EOF
+import socketserver, sys, time
+from http.server import BaseHTTPRequestHandler, HTTPServer
+# Sends half of each body, and the rest a second later, so responses stay in
+# flight for a while after their headers.
+class Handler(BaseHTTPRequestHandler):
+  def do_GET(self):
+    body = b".stalling { color: green; }\\n" * 64
+    self.send_response(200)
+    self.send_header("Content-Type", "text/css")
+    self.send_header("Cache-Control", "max-age=300")
+    self.send_header("Content-Length", str(len(body)))
+    self.end_headers()
+    self.wfile.write(body[:len(body) // 2])
+    self.wfile.flush()
+    time.sleep(1)
+    self.wfile.write(body[len(body) // 2:])
+  def log_message(self, format, *args):
+    pass
+class Server(socketserver.ThreadingMixIn, HTTPServer):
+  allow_reuse_address = True
+  daemon_threads = True
+Server(("127.0.0.1", int(sys.argv[1])), Handler).serve_forever()
+EOF
+python3 "$TEST_TMP/stalling_origin.py" $ORIGIN_PORT & ORIGIN_PID=$!
+sleep 1
+RECORDED=$(scrape_stat ipro_recorder_resources)
+SUPPRESSED=$(scrape_stat ipro_recordings_suppressed)
+URL=http://ipro-recording.example.com/claimed.css
+http_proxy=$SECONDARY_HOSTNAME $CURL -sS -o "$TEST_TMP/claimed.1" $URL &
+PID=$!
+# The first response is half sent by now, and still being recorded.
+sleep 0.5
+http_proxy=$SECONDARY_HOSTNAME check $CURL -sS -o "$TEST_TMP/claimed.2" $URL
+wait $PID
+check fgrep -q ".stalling { color: green; }" "$TEST_TMP/claimed.1"
+check fgrep -q ".stalling { color: green; }" "$TEST_TMP/claimed.2"
+check [ $(scrape_stat ipro_recorder_resources) -eq $((RECORDED + 1)) ]
+check [ $(scrape_stat ipro_recordings_suppressed) -eq $((SUPPRESSED + 1)) ]
+
+start_test A request gives up its IPRO recording claim when it finishes.
+URL=http://ipro-recording.example.com/released.css
+# Gives up half way, so nothing gets into the cache.
+http_proxy=$SECONDARY_HOSTNAME $CURL -sS --max-time 0.5 -o /dev/null $URL \
+  || true
+sleep 1
+RECORDED=$(scrape_stat ipro_recorder_resources)
+SUPPRESSED=$(scrape_stat ipro_recordings_suppressed)
+http_proxy=$SECONDARY_HOSTNAME check $CURL -sS -o "$TEST_TMP/released" $URL
+check fgrep -q ".stalling { color: green; }" "$TEST_TMP/released"
+check [ $(scrape_stat ipro_recorder_resources) -eq $((RECORDED + 1)) ]
+check [ $(scrape_stat ipro_recordings_suppressed) -eq $SUPPRESSED ]
+kill $ORIGIN_PID
+
+# Only builds that found the brotli decoder know Content-Encoding: br.
+if grep -q BrotliDecoderDecompressStream "$NGINX_EXECUTABLE" &&
+   python3 -c "import brotli" 2> /dev/null; then
+  start_test Brotli encoded html is decoded and rewritten.
+  BR_DIR="$SERVER_ROOT/mod_pagespeed_test/encoded_html/br"
+  mkdir -p "$BR_DIR"
+  python3 - "$BR_DIR" <<EOF
+import brotli, os, sys
+html = (b"<html><body><!-- br comment -->\\n" +
+        b"<p>Decoded from brotli.</p>\\n" * 200 + b"</body></html>\\n")
+encoded = brotli.compress(html)
+for name, body in [("page.html", encoded),
+                   ("truncated.html", encoded[:len(encoded) // 2]),
+                   ("corrupt.html", encoded[:16] + os.urandom(256))]:
+  with open(os.path.join(sys.argv[1], name), "wb") as f:
+    f.write(body)
+EOF
+  URL=http://encoded-html.example.com/br/page.html
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $CURL -sS -D- $URL)
+  check_from "$OUT" fgrep -q "<p>Decoded from brotli.</p>"
+  check_not_from "$OUT" fgrep -q "br comment"
+  check_not_from "$OUT" fgrep -qi "Content-Encoding: br"
+
+  start_test Truncated or corrupt brotli html does not hang the worker.
+  for page in truncated corrupt; do
+    URL=http://encoded-html.example.com/br/$page.html
+    http_proxy=$SECONDARY_HOSTNAME check $CURL -sS --max-time 10 \
+      -o /dev/null $URL
+  done
+  # The worker is still around to answer.
+  URL=http://encoded-html.example.com/br/page.html
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $CURL -sS $URL)
+  check_from "$OUT" fgrep -q "<p>Decoded from brotli.</p>"
+fi
+
+start_test Deflate encoded html is rewritten with and without the zlib header.
+DEFLATE_DIR="$SERVER_ROOT/mod_pagespeed_test/encoded_html/deflate"
+mkdir -p "$DEFLATE_DIR"
+python3 - "$DEFLATE_DIR" <<EOF
+import os, sys, zlib
+def page(name):
+  return (b"<html><body><!-- " + name + b" comment -->\\n" +
+          b"<p>Decoded from " + name + b".</p>\\n" * 200 +
+          b"</body></html>\\n")
+raw = zlib.compressobj(wbits=-zlib.MAX_WBITS)
+for name, body in [("zlib.html", zlib.compress(page(b"zlib"))),
+                   ("raw.html", raw.compress(page(b"raw")) + raw.flush())]:
+  with open(os.path.join(sys.argv[1], name), "wb") as f:
+    f.write(body)
+EOF
+# One after the other, so the worker's pooled deflate inflater decodes all
+# three: it has to fall back to raw deflate for the second, and expect a zlib
+# header again for the third.
+for page in zlib raw zlib; do
+  URL=http://encoded-html.example.com/deflate/$page.html
+  OUT=$(http_proxy=$SECONDARY_HOSTNAME $CURL -sS -D- $URL)
+  check_from "$OUT" fgrep -q "<p>Decoded from $page.</p>"
+  check_not_from "$OUT" fgrep -q "$page comment"
+  check_not_from "$OUT" fgrep -qi "Content-Encoding: deflate"
+done
+
 start_test Base config has purging disabled.  Check error message syntax.
 OUT=$($WGET_DUMP "$HOSTNAME/pagespeed_admin/cache?purge=*")
 check_from "$OUT" fgrep -q "pagespeed EnableCachePurge on;"
@@ -1455,6 +2075,14 @@ OUT=$(cat "$ERROR_LOG" \
     | grep -v "\\[warn\\].*Rewrite.*failed.*.pagespeed....0.foo.*" \
     | grep -v "\\[warn\\].*A.blue.css.*but cannot access the original.*" \
     | grep -v "\\[warn\\].*Adding function to sequence.*" \
+    | grep -v "\\[warn\\].*does-not-exist\.invalid.*" \
+    | grep -v "\\[warn\\].*dns-negative\.example\.com.*" \
+    | grep -v "\\[error\\].*multi-address\.pagespeed\.test.*" \
+    | grep -v "\\[warn\\].*TLS handshake failed for https://127\.0\.0\.1.*" \
+    | grep -v "\\[crit\\].*SSL_do_handshake() failed.*" \
+    | grep -v "\\[error\\].*fetch-upstream-hash.*" \
+    | grep -v "\\[warn\\].*fetch-upstream-hash.*" \
+    | grep -v "\\[warn\\].*Corrupted inflation.*" \
     | grep -v "\\[warn\\].*special-response.*foo.css.*but cannot access the original.*" \
     || true)
 
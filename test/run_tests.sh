@@ -67,6 +67,9 @@ fi
 : ${SECONDARY_PORT:=8051}
 : ${CONTROLLER_PORT:=8053}
 : ${RCPORT:=9991}
+: ${TLS_PORT:=8054}
+: ${ORIGIN_PORT:=8055}
+: ${DNS_PORT:=8056}
 : ${PAGESPEED_TEST_HOST:=selfsigned.modpagespeed.com}
 : ${PHP_PORT:=9000}
 
@@ -83,6 +86,9 @@ function run_test_checking_failure() {
     RUN_TESTS="$RUN_TESTS" \
     CONTROLLER_PORT="$CONTROLLER_PORT" \
     RCPORT="$RCPORT" \
+    TLS_PORT="$TLS_PORT" \
+    ORIGIN_PORT="$ORIGIN_PORT" \
+    DNS_PORT="$DNS_PORT" \
     bash "$this_dir/nginx_system_test.sh"
   STATUS=$?
   echo "With $@ setup."